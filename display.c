@@ -23,6 +23,7 @@
 #include "setup.h"
 
 #include <vdr/tools.h>
+#include <vdr/thread.h>
 
 extern "C" {
 #include "interface/vmcs_host/vc_tvservice.h"
@@ -101,12 +102,19 @@ cRpiDisplay::cRpiDisplay(int id, int width, int height, int frameRate,
 	m_frameRate(frameRate),
 	m_aspectRatio(aspectRatio),
 	m_interlaced(interlaced),
-	m_fixedMode(fixedMode)
+	m_fixedMode(fixedMode),
+	m_snapshotDisplay(DISPMANX_NO_HANDLE),
+	m_snapshotResource(DISPMANX_NO_HANDLE),
+	m_snapshotWidth(0),
+	m_snapshotHeight(0),
+	m_snapshotMutex(new cMutex())
 {
 }
 
 cRpiDisplay::~cRpiDisplay()
 {
+	ReleaseSnapshot();
+	delete m_snapshotMutex;
 }
 
 int cRpiDisplay::GetSize(int &width, int &height)
@@ -191,32 +199,72 @@ int cRpiDisplay::GetId(void)
 	return false;
 }
 
-int cRpiDisplay::Snapshot(unsigned char* frame, int width, int height)
+int cRpiDisplay::Snapshot(unsigned char* frame, int width, int height,
+		bool videoOnly)
 {
+	int ret = -1;
 	cRpiDisplay* instance = GetInstance();
 	if (instance)
 	{
-		DISPMANX_DISPLAY_HANDLE_T display = vc_dispmanx_display_open(
-				instance->m_id);
+		instance->m_snapshotMutex->Lock();
 
-		if (display)
+		// display and resource are kept open for subsequent grabs of the
+		// same size and released on size or display mode changes
+		if (instance->m_snapshotResource != DISPMANX_NO_HANDLE && (
+				instance->m_snapshotWidth != width ||
+				instance->m_snapshotHeight != height))
+		{
+			vc_dispmanx_resource_delete(instance->m_snapshotResource);
+			instance->m_snapshotResource = DISPMANX_NO_HANDLE;
+		}
+
+		if (instance->m_snapshotDisplay == DISPMANX_NO_HANDLE)
+			instance->m_snapshotDisplay =
+					vc_dispmanx_display_open(instance->m_id);
+
+		if (instance->m_snapshotDisplay != DISPMANX_NO_HANDLE &&
+				instance->m_snapshotResource == DISPMANX_NO_HANDLE)
 		{
 			uint32_t image;
-			DISPMANX_RESOURCE_HANDLE_T res = vc_dispmanx_resource_create(
+			instance->m_snapshotResource = vc_dispmanx_resource_create(
 					VC_IMAGE_RGB888, width, height, &image);
+			instance->m_snapshotWidth = width;
+			instance->m_snapshotHeight = height;
+		}
 
-			vc_dispmanx_snapshot(display, res,
-					(DISPMANX_TRANSFORM_T)(DISPMANX_SNAPSHOT_PACK));
+		if (instance->m_snapshotDisplay != DISPMANX_NO_HANDLE &&
+				instance->m_snapshotResource != DISPMANX_NO_HANDLE)
+		{
+			// the HVS scales the composed display to the resource's size,
+			// without RGB layers (OSD, console) only the video is captured
+			vc_dispmanx_snapshot(instance->m_snapshotDisplay,
+					instance->m_snapshotResource,
+					(DISPMANX_TRANSFORM_T)(DISPMANX_SNAPSHOT_PACK |
+					(videoOnly ? DISPMANX_SNAPSHOT_NO_RGB : 0)));
 
 			VC_RECT_T rect = { 0, 0, width, height };
-			vc_dispmanx_resource_read_data(res, &rect, frame, width * 3);
-
-			vc_dispmanx_resource_delete(res);
-			vc_dispmanx_display_close(display);
-			return 0;
+			vc_dispmanx_resource_read_data(instance->m_snapshotResource,
+					&rect, frame, width * 3);
+			ret = 0;
 		}
+
+		instance->m_snapshotMutex->Unlock();
 	}
-	return -1;
+	return ret;
+}
+
+void cRpiDisplay::ReleaseSnapshot(void)
+{
+	m_snapshotMutex->Lock();
+	if (m_snapshotResource != DISPMANX_NO_HANDLE)
+		vc_dispmanx_resource_delete(m_snapshotResource);
+
+	if (m_snapshotDisplay != DISPMANX_NO_HANDLE)
+		vc_dispmanx_display_close(m_snapshotDisplay);
+
+	m_snapshotResource = DISPMANX_NO_HANDLE;
+	m_snapshotDisplay = DISPMANX_NO_HANDLE;
+	m_snapshotMutex->Unlock();
 }
 
 void cRpiDisplay::GetModeFormat(const cVideoFrameFormat *format,
@@ -362,8 +410,11 @@ int cRpiDisplay::Update(const cVideoFrameFormat *frameFormat)
 	if (newWidth != m_width || newHeight != m_height ||
 			newFrameRate != m_frameRate || newInterlaced != m_interlaced ||
 			newAspectRatio != m_aspectRatio)
+	{
+		ReleaseSnapshot();
 		return SetMode(newWidth, newHeight, newFrameRate, newAspectRatio,
 				newInterlaced ? frameFormat->scanMode : cScanMode::eProgressive);
+	}
 
 	return 0;
 }
@@ -532,7 +583,13 @@ void cRpiHDMIDisplay::TvServiceCallback(void *data, unsigned int reason,
 		unsigned int param1, unsigned int param2)
 {
 	if (reason & VC_HDMI_DVI + VC_HDMI_HDMI)
+	{
+		// callback is only registered while an HDMI display is instantiated
+		if (s_instance)
+			static_cast<cRpiHDMIDisplay*>(s_instance)->ReleaseSnapshot();
+
 		cRpiOsdProvider::ResetOsd();
+	}
 }
 
 /* ------------------------------------------------------------------------- */
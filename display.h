@@ -22,6 +22,8 @@
 
 #include "tools.h"
 
+class cMutex;
+
 class cRpiDisplay
 {
 
@@ -38,7 +40,8 @@ public:
 
 	static int GetId(void);
 
-	static int Snapshot(unsigned char* frame, int width, int height);
+	static int Snapshot(unsigned char* frame, int width, int height,
+			bool videoOnly = false);
 
 	static int SetVideoFormat(const cVideoFrameFormat *frameFormat);
 
@@ -62,6 +65,8 @@ protected:
 
 	static const char* AspectRatioStr(int aspectRatio);
 
+	void ReleaseSnapshot(void);
+
 	int m_id;
 	int m_width;
 	int m_height;
@@ -70,6 +75,13 @@ protected:
 	bool m_interlaced;
 	bool m_fixedMode;
 
+	// dispmanx handles kept between snapshots of the same size
+	uint32_t m_snapshotDisplay;
+	uint32_t m_snapshotResource;
+	int m_snapshotWidth;
+	int m_snapshotHeight;
+	cMutex *m_snapshotMutex;
+
 	static cRpiDisplay *s_instance;
 
 private:
@@ -0,0 +1,331 @@
+/*
+ * rpihddevice - VDR HD output device for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "jpeg.h"
+#include "tools.h"
+
+#include <vdr/tools.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <algorithm>
+
+extern "C" {
+#include <jpeglib.h>
+#include <jerror.h>
+}
+
+#define JPEG_MAX_STRIPES 8
+#define JPEG_MCU_SIZE 16
+#define JPEG_BUFFER_INCREMENT KILOBYTE(64)
+
+/* ------------------------------------------------------------------------- */
+
+// encodes a part of the image as complete JPEG stream into a growing memory
+// buffer, the entropy coded segment is extracted later for concatenation
+
+class cRpiJpegEncoder::cStripe
+{
+
+public:
+
+	cStripe() :
+		rgb(0), width(0), height(0), quality(0), restartInterval(0),
+		data(0), size(0), ok(false)
+	{ }
+
+	~cStripe()
+	{
+		free(data);
+	}
+
+	void Encode(void)
+	{
+		jpeg_compress_struct cinfo;
+		tErrorMgr err;
+		tDestinationMgr dest;
+
+		cinfo.err = jpeg_std_error(&err.mgr);
+		err.mgr.error_exit = ErrorExit;
+
+		dest.mgr.init_destination = InitDestination;
+		dest.mgr.empty_output_buffer = EmptyOutputBuffer;
+		dest.mgr.term_destination = TermDestination;
+		dest.stripe = this;
+
+		if (setjmp(err.jmp))
+		{
+			jpeg_destroy_compress(&cinfo);
+			ok = false;
+			return;
+		}
+
+		jpeg_create_compress(&cinfo);
+		cinfo.dest = &dest.mgr;
+		cinfo.image_width = width;
+		cinfo.image_height = height;
+		cinfo.input_components = 3;
+		cinfo.in_color_space = JCS_RGB;
+
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, quality, TRUE);
+		cinfo.restart_interval = restartInterval;
+		jpeg_start_compress(&cinfo, TRUE);
+
+		while (cinfo.next_scanline < cinfo.image_height)
+		{
+			JSAMPROW row = (JSAMPROW)(rgb + cinfo.next_scanline * width * 3);
+			jpeg_write_scanlines(&cinfo, &row, 1);
+		}
+
+		jpeg_finish_compress(&cinfo);
+		jpeg_destroy_compress(&cinfo);
+		ok = true;
+	}
+
+	const uint8_t *rgb;
+	int width;
+	int height;
+	int quality;
+	int restartInterval;
+
+	uint8_t *data;
+	int size;
+	bool ok;
+
+private:
+
+	cStripe(const cStripe&);
+	cStripe& operator= (const cStripe&);
+
+	struct tErrorMgr {
+		jpeg_error_mgr mgr;
+		jmp_buf jmp;
+	};
+
+	struct tDestinationMgr {
+		jpeg_destination_mgr mgr;
+		cStripe *stripe;
+	};
+
+	static void ErrorExit(j_common_ptr cinfo)
+	{
+		char msg[JMSG_LENGTH_MAX];
+		(*cinfo->err->format_message)(cinfo, msg);
+		ELOG("failed to encode JPEG image: %s", msg);
+		longjmp(((tErrorMgr*)cinfo->err)->jmp, 1);
+	}
+
+	static void InitDestination(j_compress_ptr cinfo)
+	{
+		tDestinationMgr *dest = (tDestinationMgr*)cinfo->dest;
+		cStripe *stripe = dest->stripe;
+
+		if (!stripe->data)
+		{
+			stripe->data = MALLOC(uint8_t, JPEG_BUFFER_INCREMENT);
+			if (!stripe->data)
+				ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+
+			stripe->size = JPEG_BUFFER_INCREMENT;
+		}
+		dest->mgr.next_output_byte = stripe->data;
+		dest->mgr.free_in_buffer = stripe->size;
+	}
+
+	static boolean EmptyOutputBuffer(j_compress_ptr cinfo)
+	{
+		tDestinationMgr *dest = (tDestinationMgr*)cinfo->dest;
+		cStripe *stripe = dest->stripe;
+
+		// whole buffer has been filled, ignoring free_in_buffer
+		int used = stripe->size;
+		uint8_t *data = (uint8_t*)realloc(stripe->data,
+				stripe->size + JPEG_BUFFER_INCREMENT);
+		if (!data)
+			ERREXIT(cinfo, JERR_OUT_OF_MEMORY);
+
+		stripe->data = data;
+		stripe->size += JPEG_BUFFER_INCREMENT;
+		dest->mgr.next_output_byte = stripe->data + used;
+		dest->mgr.free_in_buffer = stripe->size - used;
+		return TRUE;
+	}
+
+	static void TermDestination(j_compress_ptr cinfo)
+	{
+		tDestinationMgr *dest = (tDestinationMgr*)cinfo->dest;
+		dest->stripe->size -= dest->mgr.free_in_buffer;
+	}
+};
+
+/* ------------------------------------------------------------------------- */
+
+void* cRpiJpegEncoder::StripeThread(void *stripe)
+{
+	static_cast<cStripe*>(stripe)->Encode();
+	return 0;
+}
+
+int cRpiJpegEncoder::NumCores(void)
+{
+	int cores = sysconf(_SC_NPROCESSORS_ONLN);
+	return cores > 0 ? cores : 1;
+}
+
+uint8_t* cRpiJpegEncoder::Encode(const uint8_t *rgb, int width, int height,
+		int quality, int &size, int threads)
+{
+	if (!rgb || width <= 0 || height <= 0)
+		return 0;
+
+	// stripes are made of complete MCU rows of 4:2:0 sampled images and
+	// must not exceed the maximum restart interval
+	int mcuRows = (height + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE;
+	int mcuCols = (width + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE;
+
+	int numStripes = constrain(threads > 0 ? threads : NumCores(),
+			1, JPEG_MAX_STRIPES);
+	numStripes = std::min(numStripes, mcuRows);
+
+	int stripeRows = (mcuRows + numStripes - 1) / numStripes;
+	while (stripeRows * mcuCols > 0xffff)
+	{
+		numStripes++;
+		stripeRows = (mcuRows + numStripes - 1) / numStripes;
+	}
+
+	numStripes = (mcuRows + stripeRows - 1) / stripeRows;
+	stripeRows *= JPEG_MCU_SIZE;
+
+	cStripe *stripes = new cStripe[numStripes];
+	pthread_t *tids = new pthread_t[numStripes];
+	bool *started = new bool[numStripes];
+
+	for (int i = 0; i < numStripes; i++)
+	{
+		stripes[i].rgb = rgb + i * stripeRows * width * 3;
+		stripes[i].width = width;
+		stripes[i].height = std::min(stripeRows, height - i * stripeRows);
+		stripes[i].quality = quality;
+		stripes[i].restartInterval = numStripes > 1 ?
+				stripeRows / JPEG_MCU_SIZE * mcuCols : 0;
+	}
+
+	// first stripe is encoded by the calling thread
+	for (int i = 1; i < numStripes; i++)
+		started[i] = !pthread_create(&tids[i], 0, StripeThread, &stripes[i]);
+
+	stripes[0].Encode();
+
+	for (int i = 1; i < numStripes; i++)
+	{
+		if (started[i])
+			pthread_join(tids[i], 0);
+		else
+			stripes[i].Encode();
+	}
+
+	uint8_t *ret = 0;
+	size = 0;
+
+	// locate entropy coded segments between SOS header and EOI marker
+	int *scanStart = new int[numStripes];
+	bool ok = true;
+	int headerSize = 0, sofOffset = 0;
+
+	for (int i = 0; i < numStripes && ok; i++)
+	{
+		const uint8_t *data = stripes[i].data;
+		int length = stripes[i].size;
+		ok = stripes[i].ok && length > 4 && data[0] == 0xff && data[1] == 0xd8 &&
+				data[length - 2] == 0xff && data[length - 1] == 0xd9;
+
+		scanStart[i] = 0;
+		for (int p = 2; ok && !scanStart[i] && p + 4 <= length; )
+		{
+			if (data[p] != 0xff)
+				ok = false;
+			else
+			{
+				int marker = data[p + 1];
+				int segment = 2 + (data[p + 2] << 8 | data[p + 3]);
+
+				if (marker == 0xc0 && !i)
+					sofOffset = p;
+
+				if (marker == 0xda)
+					scanStart[i] = p + segment;
+
+				p += segment;
+			}
+		}
+		if (!scanStart[i] || scanStart[i] > length - 2)
+			ok = false;
+
+		if (ok)
+			size += stripes[i].size - 2 - scanStart[i];
+	}
+
+	if (ok && sofOffset)
+	{
+		headerSize = scanStart[0];
+		size += headerSize + (numStripes - 1) * 2 + 2;
+		ret = MALLOC(uint8_t, size);
+	}
+	else
+		ELOG("failed to compose JPEG image!");
+
+	if (ret)
+	{
+		uint8_t *p = ret;
+		memcpy(p, stripes[0].data, headerSize);
+
+		// first stripe's frame header carries the stripe's height
+		p[sofOffset + 5] = height >> 8;
+		p[sofOffset + 6] = height & 0xff;
+		p += headerSize;
+
+		for (int i = 0; i < numStripes; i++)
+		{
+			if (i)
+			{
+				*p++ = 0xff;
+				*p++ = 0xd0 + ((i - 1) & 7);
+			}
+			int length = stripes[i].size - 2 - scanStart[i];
+			memcpy(p, stripes[i].data + scanStart[i], length);
+			p += length;
+		}
+		*p++ = 0xff;
+		*p++ = 0xd9;
+	}
+	else
+		size = 0;
+
+	delete[] scanStart;
+	delete[] started;
+	delete[] tids;
+	delete[] stripes;
+	return ret;
+}
@@ -0,0 +1,51 @@
+/*
+ * rpihddevice - VDR HD output device for Raspberry Pi
+ * Copyright (C) 2014, 2015, 2016 Thomas Reufer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef JPEG_H
+#define JPEG_H
+
+#include <stdint.h>
+
+/*
+ * JPEG encoder for RGB888 images, which splits the image into horizontal
+ * stripes of one restart interval each. The stripes are encoded in parallel
+ * and concatenated to a single baseline JPEG stream with RST markers.
+ */
+
+class cRpiJpegEncoder
+{
+
+public:
+
+	// returns image allocated with malloc() or NULL in case of an error
+	static uint8_t* Encode(const uint8_t *rgb, int width, int height,
+			int quality, int &size, int threads = 0);
+
+	static int NumCores(void);
+
+private:
+
+	class cStripe;
+
+	static void* StripeThread(void *stripe);
+
+	cRpiJpegEncoder();
+};
+
+#endif
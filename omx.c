@@ -17,7 +17,8 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
-#include <queue>
+#include <algorithm>
+#include <time.h>
 
 #include "omx.h"
 #include "display.h"
@@ -32,13 +33,39 @@ extern "C" {
 
 #include "bcm_host.h"
 
-// default: 20x 81920 bytes, now 128x 64k (8M)
+// default: 20x 81920 bytes, now 128x 64k (8M) for H.264 and at least 64x 64k
+// for MPEG2, increased to hold OMX_VIDEO_BUFFER_DURATION of the previous stream
 #define OMX_VIDEO_BUFFERS 128
-#define OMX_VIDEO_BUFFERSIZE KILOBYTE(64);
+#define OMX_VIDEO_MIN_BUFFERS 64
+#define OMX_VIDEO_MAX_BUFFERS 512
+#define OMX_VIDEO_BUFFERSIZE KILOBYTE(64)
+#define OMX_VIDEO_BUFFER_DURATION 2500	// ms
 
-// default: 16x 4096 bytes, now 128x 16k (2M)
+// default: 16x 4096 bytes, now 128x 16k (2M), DTS with its short frames gets
+// twice as many and decoded PCM buffers hold a complete frame
 #define OMX_AUDIO_BUFFERS 128
-#define OMX_AUDIO_BUFFERSIZE KILOBYTE(16);
+#define OMX_AUDIO_MAX_BUFFERS 256
+#define OMX_AUDIO_BUFFERSIZE KILOBYTE(16)
+#define OMX_AUDIO_MAX_FRAME_SAMPLES 2048
+
+// clock's media time is read at most this often for GetCachedSTC() and
+// interpolated in between
+#define OMX_STC_CACHE_INTERVAL 100	// ms
+
+#define OMX_EVENT_WAIT_TIMEOUT 100	// ms
+#define OMX_EVENTSTAT_INTERVAL 10000	// ms
+
+// completion of state changes is checked this often while a video tunnel is
+// being set up, steps not completed within the timeout are given up
+#define OMX_TUNNEL_SETUP_POLL 2			// ms
+#define OMX_TUNNEL_SETUP_TIMEOUT 1000	// ms
+
+static uint64_t NowUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
 
 #define OMX_INIT_STRUCT(a) \
 	memset(&(a), 0, sizeof(a)); \
@@ -73,6 +100,13 @@ default: \
 	(s).eChannelMapping[1] = OMX_AUDIO_ChannelRF; \
 	break; }
 
+// single producer, single consumer ring of events, filled by the OMX callbacks
+// which are all invoked on the IL client's callback thread and emptied by
+// cOmx::Action(). adding an event doesn't allocate memory and takes the mutex
+// of the consumer's wake-up condition only briefly. if the ring is full, the
+// event is dropped and counted. the consumer sleeps in Wait() until an event
+// has been added or Signal() has been called
+
 class cOmxEvents
 {
 
@@ -87,47 +121,69 @@ public:
 
 	struct Event
 	{
-		Event(eEvent _event, int _data)
-			: event(_event), data(_data) { };
 		eEvent 	event;
 		int		data;
+#ifdef DEBUG_EVENTSTAT
+		uint64_t time;
+#endif
 	};
 
 	cOmxEvents() :
-		m_signal(new cCondWait()),
-		m_mutex(new cMutex())
+		m_head(0),
+		m_tail(0),
+		m_overflows(0)
 	{ }
 
-	virtual ~cOmxEvents()
+	// consumer side
+	bool Get(Event &event)
 	{
-		while (!m_events.empty())
-		{
-			delete m_events.front();
-			m_events.pop();
-		}
-		delete m_signal;
-		delete m_mutex;
+		unsigned int tail = m_tail;
+		if (tail == __atomic_load_n(&m_head, __ATOMIC_ACQUIRE))
+			return false;
+
+		event = m_events[tail % SIZE];
+		__atomic_store_n(&m_tail, tail + 1, __ATOMIC_RELEASE);
+		return true;
 	}
 
-	Event* Get(void)
+	// producer side, returns false if the event has been dropped
+	bool Add(eEvent event, int data)
 	{
-		Event* event = 0;
-		if (!m_events.empty())
+		unsigned int head = m_head;
+		if (head - __atomic_load_n(&m_tail, __ATOMIC_ACQUIRE) >= SIZE)
 		{
-			m_mutex->Lock();
-			event = m_events.front();
-			m_events.pop();
-			m_mutex->Unlock();
+			__atomic_fetch_add(&m_overflows, 1, __ATOMIC_RELAXED);
+			return false;
 		}
-		return event;
+		m_events[head % SIZE].event = event;
+		m_events[head % SIZE].data = data;
+#ifdef DEBUG_EVENTSTAT
+		m_events[head % SIZE].time = NowUs();
+#endif
+		__atomic_store_n(&m_head, head + 1, __ATOMIC_RELEASE);
+		m_signal.Signal();
+		return true;
 	}
 
-	void Add(Event* event)
+	// consumer side, returns false on timeout
+	bool Wait(int timeoutMs)
 	{
-		m_mutex->Lock();
-		m_events.push(event);
-		m_mutex->Unlock();
-		m_signal->Signal();
+		if (m_tail != __atomic_load_n(&m_head, __ATOMIC_ACQUIRE))
+			return true;
+
+		return m_signal.Wait(timeoutMs);
+	}
+
+	// wakes up the consumer without adding an event
+	void Signal(void)
+	{
+		m_signal.Signal();
+	}
+
+	// returns and resets the number of dropped events
+	int Overflows(void)
+	{
+		return __atomic_exchange_n(&m_overflows, 0, __ATOMIC_RELAXED);
 	}
 
 private:
@@ -135,9 +191,282 @@ private:
 	cOmxEvents(const cOmxEvents&);
 	cOmxEvents& operator= (const cOmxEvents&);
 
-	cCondWait*	m_signal;
-	cMutex*		m_mutex;
-	std::queue<Event*> m_events;
+	// more than the input buffers of both ports, which can be pending at
+	// once, and a power of two, so the indices can wrap around
+	enum { SIZE = 2048 };
+
+	Event m_events[SIZE];
+	unsigned int m_head;
+	unsigned int m_tail;
+	int m_overflows;
+
+	cCondWait m_signal;
+};
+
+// time stamps of the buffers passed to the OMX components, in the order
+// they are going to be returned
+
+class cOmxPtsQueue
+{
+
+public:
+
+	cOmxPtsQueue() :
+		m_head(0),
+		m_tail(0),
+		m_latest(OMX_INVALID_PTS)
+	{ }
+
+	void Reset(void)
+	{
+		m_head = 0;
+		m_tail = 0;
+		m_latest = OMX_INVALID_PTS;
+	}
+
+	void Invalidate(void)
+	{
+		m_latest = OMX_INVALID_PTS;
+	}
+
+	void Push(int64_t pts)
+	{
+		m_pts[m_head] = pts;
+		m_head = (m_head + 1) % SIZE;
+		if (m_head == m_tail)
+			m_tail = (m_tail + 1) % SIZE;
+
+		if (pts != OMX_INVALID_PTS)
+			m_latest = pts;
+	}
+
+	void Pop(void)
+	{
+		if (m_tail != m_head)
+			m_tail = (m_tail + 1) % SIZE;
+	}
+
+	int64_t Latest(void)
+	{
+		return m_latest;
+	}
+
+	int64_t Oldest(void)
+	{
+		for (int i = m_tail; i != m_head; i = (i + 1) % SIZE)
+			if (m_pts[i] != OMX_INVALID_PTS)
+				return m_pts[i];
+
+		return OMX_INVALID_PTS;
+	}
+
+private:
+
+	cOmxPtsQueue(const cOmxPtsQueue&);
+	cOmxPtsQueue& operator= (const cOmxPtsQueue&);
+
+	// one more than the buffers of a port, so a full queue isn't empty
+	enum { SIZE = (OMX_VIDEO_MAX_BUFFERS > OMX_AUDIO_MAX_BUFFERS ?
+			OMX_VIDEO_MAX_BUFFERS : OMX_AUDIO_MAX_BUFFERS) + 1 };
+
+	int64_t m_pts[SIZE];
+	int m_head;
+	int m_tail;
+	int64_t m_latest;
+};
+
+// number of used input buffers of a port, sampled into a sliding window. the
+// running sum and a histogram of the window with one bin per possible number
+// of used buffers are updated with each sample, so neither the average nor the
+// percentiles need to go through the whole window
+
+#define BUFFERSTAT_FILTER_SIZE 64
+
+class cOmxBufferStat
+{
+
+public:
+
+	cOmxBufferStat(int buffers) :
+		m_buffers(0),
+		m_histogram(0)
+	{
+		Reset(buffers);
+	}
+
+	~cOmxBufferStat()
+	{
+		delete[] m_histogram;
+	}
+
+	void Reset(int buffers)
+	{
+		if (buffers != m_buffers)
+		{
+			delete[] m_histogram;
+			m_histogram = new int[buffers + 1];
+			m_buffers = buffers;
+		}
+		m_used = 0;
+		m_exhausted = 0;
+		m_sum = 0;
+		m_index = 0;
+		for (int i = 0; i < BUFFERSTAT_FILTER_SIZE; i++)
+			m_window[i] = 0;
+		for (int i = 0; i <= m_buffers; i++)
+			m_histogram[i] = 0;
+		m_histogram[0] = BUFFERSTAT_FILTER_SIZE;
+	}
+
+	void Inc(void) { m_used++; }
+	void Dec(void) { m_used--; }
+
+	// counts requests which found all buffers in use
+	void Exhausted(void) { m_exhausted++; }
+	int Exhaustions(void) const { return m_exhausted; }
+
+	int Buffers(void) const { return m_buffers; }
+
+	// currently used buffers in percent
+	int Used(void) const
+	{
+		return m_used * 100 / m_buffers;
+	}
+
+	// replaces the oldest sample of the window by the current usage
+	void Sample(void)
+	{
+		int used = constrain(m_used, 0, m_buffers);
+		int oldest = m_window[m_index];
+
+		m_sum += used - oldest;
+		m_histogram[oldest]--;
+		m_histogram[used]++;
+
+		m_window[m_index] = used;
+		m_index = (m_index + 1) % BUFFERSTAT_FILTER_SIZE;
+	}
+
+	// average usage of the window in percent
+	int Average(void) const
+	{
+		return m_sum * 100 / BUFFERSTAT_FILTER_SIZE / m_buffers;
+	}
+
+	// usage in percent, which isn't exceeded by the given percentage of the
+	// samples, 0 returns the minimum and 100 the maximum usage of the window
+	int Percentile(int percent) const
+	{
+		int rank = percent * (BUFFERSTAT_FILTER_SIZE - 1) / 100;
+		for (int used = 0, count = 0; used <= m_buffers; used++)
+		{
+			count += m_histogram[used];
+			if (count > rank)
+				return used * 100 / m_buffers;
+		}
+		return 100;
+	}
+
+private:
+
+	cOmxBufferStat(const cOmxBufferStat&);
+	cOmxBufferStat& operator= (const cOmxBufferStat&);
+
+	int m_buffers;
+	int m_used;
+	int m_exhausted;
+	int m_sum;
+	int m_index;
+	int m_window[BUFFERSTAT_FILTER_SIZE];
+	int *m_histogram;
+};
+
+// input buffers of a port, allocated by the plugin as one contiguous block and
+// registered with OMX_UseBuffer() by ilclient. the block is freed as soon as
+// all buffers have been released when the port gets disabled
+
+class cOmxBufferPool
+{
+
+public:
+
+	cOmxBufferPool(int count) :
+		m_block(0),
+		m_count(count),
+		m_blockCount(0),
+		m_size(0),
+		m_next(0),
+		m_used(0)
+	{ }
+
+	~cOmxBufferPool()
+	{
+		free(m_block);
+	}
+
+	static void* Malloc(void *pool, VCOS_UNSIGNED size, VCOS_UNSIGNED align,
+			const char *description)
+	{
+		return static_cast <cOmxBufferPool*> (pool)->Allocate(size, align);
+	}
+
+	static void Free(void *pool, void *buf)
+	{
+		static_cast <cOmxBufferPool*> (pool)->Release(buf);
+	}
+
+	// takes effect with the next allocation of the port's buffers
+	void SetCount(int count)
+	{
+		m_count = count;
+	}
+
+private:
+
+	cOmxBufferPool(const cOmxBufferPool&);
+	cOmxBufferPool& operator= (const cOmxBufferPool&);
+
+	void* Allocate(unsigned int size, unsigned int align)
+	{
+		align = std::max(align, (unsigned int)sizeof(void*));
+		size = (size + align - 1) / align * align;
+
+		if (!m_block)
+		{
+			if (posix_memalign(&m_block, align, size * m_count))
+			{
+				ELOG("failed to allocate %d OMX buffers of %d bytes!",
+						m_count, size);
+				m_block = 0;
+				return 0;
+			}
+			m_size = size;
+			m_blockCount = m_count;
+			m_next = 0;
+		}
+		if (size != m_size || m_next >= m_blockCount)
+			return 0;
+
+		m_used++;
+		return static_cast <uint8_t*> (m_block) + m_size * m_next++;
+	}
+
+	void Release(void *buf)
+	{
+		if (m_used && !--m_used)
+		{
+			free(m_block);
+			m_block = 0;
+			m_next = 0;
+		}
+	}
+
+	void *m_block;
+	int m_count;
+	int m_blockCount;
+	unsigned int m_size;
+	int m_next;
+	int m_used;
 };
 
 const char* cOmx::errStr(int err)
@@ -193,19 +522,57 @@ const char* cOmx::errStr(int err)
 void cOmx::Action(void)
 {
 	cTimeMs timer;
+	bool tunnelSetup = false;
+
+#ifdef DEBUG_EVENTSTAT
+	cTimeMs statTimer(OMX_EVENTSTAT_INTERVAL);
+	int wakeUps = 0, idleWakeUps = 0, events = 0;
+	uint64_t latencyUs = 0, maxLatencyUs = 0;
+#endif
+
 	while (Running())
 	{
-		while (cOmxEvents::Event* event = m_portEvents->Get())
+		// the timeout is only needed for the buffer statistics and to check
+		// the progress of a pending tunnel setup
+		bool signaled = m_portEvents->Wait(tunnelSetup ?
+				OMX_TUNNEL_SETUP_POLL : OMX_EVENT_WAIT_TIMEOUT);
+		if (!Running())
+			break;
+
+#ifdef DEBUG_EVENTSTAT
+		wakeUps++;
+		if (!signaled)
+			idleWakeUps++;
+#else
+		(void)signaled;
+#endif
+
+		Lock();
+		bool videoFrameFormatPreset = m_videoFrameFormatPreset;
+		m_videoFrameFormatPreset = false;
+		Unlock();
+
+		if (videoFrameFormatPreset && m_handlePortEvents)
+			HandleVideoFrameFormatPreset();
+
+		cOmxEvents::Event event;
+		while (m_portEvents->Get(event))
 		{
-			switch (event->event)
+#ifdef DEBUG_EVENTSTAT
+			uint64_t latency = NowUs() - event.time;
+			latencyUs += latency;
+			maxLatencyUs = std::max(maxLatencyUs, latency);
+			events++;
+#endif
+			switch (event.event)
 			{
 			case cOmxEvents::ePortSettingsChanged:
 				if (m_handlePortEvents)
-					HandlePortSettingsChanged(event->data);
+					HandlePortSettingsChanged(event.data);
 				break;
 
 			case cOmxEvents::eConfigChanged:
-				switch (event->data)
+				switch (event.data)
 				{
 				case OMX_IndexParamBrcmPixelAspectRatio:
 					if (m_handlePortEvents)
@@ -221,87 +588,217 @@ void cOmx::Action(void)
 				break;
 
 			case cOmxEvents::eEndOfStream:
-				if (event->data == 90 && m_onEndOfStream)
+				if (event.data == 90 && m_onEndOfStream)
 					m_onEndOfStream(m_onEndOfStreamData);
 				break;
 
 			case cOmxEvents::eBufferEmptied:
-				HandlePortBufferEmptied((eOmxComponent)event->data);
+				HandlePortBufferEmptied((eOmxComponent)event.data);
 				break;
 
 			default:
 				break;
 			}
-
-			delete event;
 		}
-		cCondWait::SleepMs(10);
 
+		if (int overflows = m_portEvents->Overflows())
+			ELOG("%d OMX events lost!", overflows);
+
+		// emptied buffers which didn't fit into the ring have been counted,
+		// so the buffer statistics and time stamps of the ports stay in sync
+		for (int i = 0; i < eNumComponents; i++)
+			for (int n = __atomic_exchange_n(&m_lostBuffersEmptied[i], 0,
+					__ATOMIC_RELAXED); n > 0; n--)
+				HandlePortBufferEmptied((eOmxComponent)i);
+
+		// one step per iteration, so events are handled in between
+		tunnelSetup = ContinueTunnelSetup(false);
+
+		// the callback takes the device's lock, so it's invoked without ours
+		Lock();
+		bool videoRenderStarted = m_videoRenderStarted;
+		m_videoRenderStarted = false;
+		Unlock();
+
+		if (videoRenderStarted && m_onFirstPicture)
+			m_onFirstPicture(m_onFirstPictureData);
+
+#ifdef DEBUG_EVENTSTAT
+		if (statTimer.TimedOut())
+		{
+			DLOG("OMX events: %d events, latency avg %lluus, max %lluus, "
+					"%d wake-ups, %d idle", events,
+					latencyUs / std::max(events, 1), maxLatencyUs,
+					wakeUps, idleWakeUps);
+
+			statTimer.Set(OMX_EVENTSTAT_INTERVAL);
+			wakeUps = idleWakeUps = events = 0;
+			latencyUs = maxLatencyUs = 0;
+		}
+#endif
 		if (timer.TimedOut())
 		{
-			timer.Set(100);
-			Lock();
-			for (int i = BUFFERSTAT_FILTER_SIZE - 1; i > 0; i--)
+			timer.Set(OMX_EVENT_WAIT_TIMEOUT);
+			m_audioMutex.Lock();
+			m_audioBufferStat->Sample();
+			bool audioPlaying = m_audioPts->Latest() != OMX_INVALID_PTS;
+			m_audioMutex.Unlock();
+
+			// audio render has played all data it has been given, counted
+			// once per gap. the latency is queried without the audio lock,
+			// since it waits for the render
+			bool audioRunDry = audioPlaying && !GetAudioLatency();
+
+			m_audioMutex.Lock();
+			if (audioRunDry && !m_audioRunDry)
+				m_audioUnderruns++;
+			m_audioRunDry = audioRunDry;
+			int audioUnderruns = m_audioUnderruns;
+			m_audioMutex.Unlock();
+
+			m_videoMutex.Lock();
+			m_videoBufferStat->Sample();
+
+			// peak video data rate over one second, used to size the
+			// buffers of the next stream
+			uint64_t now = cTimeMs::Now();
+			if (now - m_videoBytesTime >= 1000)
 			{
-				m_usedAudioBuffers[i] = m_usedAudioBuffers[i - 1];
-				m_usedVideoBuffers[i] = m_usedVideoBuffers[i - 1];
+				if (m_videoBytesTime)
+					m_videoPeakRate = std::max(m_videoPeakRate,
+							(int)(m_videoBytes * 1000 / (now - m_videoBytesTime)));
+
+				m_videoBytes = 0;
+				m_videoBytesTime = now;
+			}
+			m_videoMutex.Unlock();
+
+			// audio buffers emptied during a video reconfiguration are
+			// accounted afterwards, so wait a bit before reporting
+			if (m_videoReconfigTime && now - m_videoReconfigTime > 1000)
+			{
+				DLOG("audio underruns around video reconfiguration: %d",
+						audioUnderruns - m_videoReconfigUnderruns);
+				m_videoReconfigTime = 0;
 			}
-			Unlock();
 		}
 	}
 }
 
 bool cOmx::PollVideo(void)
 {
-	return (m_usedVideoBuffers[0] * 100 / OMX_VIDEO_BUFFERS) < 90;
+	m_videoMutex.Lock();
+	bool ret = m_videoBufferStat->Used() < 90;
+	m_videoMutex.Unlock();
+	return ret;
 }
 
 void cOmx::GetBufferUsage(int &audio, int &video)
 {
-	audio = 0;
-	video = 0;
-	for (int i = 0; i < BUFFERSTAT_FILTER_SIZE; i++)
+	m_audioMutex.Lock();
+	audio = m_audioBufferStat->Average();
+	m_audioMutex.Unlock();
+
+	m_videoMutex.Lock();
+	video = m_videoBufferStat->Average();
+	m_videoMutex.Unlock();
+}
+
+void cOmx::GetBufferUsage(int &audio, int &video, int percentile)
+{
+	m_audioMutex.Lock();
+	audio = m_audioBufferStat->Percentile(percentile);
+	m_audioMutex.Unlock();
+
+	m_videoMutex.Lock();
+	video = m_videoBufferStat->Percentile(percentile);
+	m_videoMutex.Unlock();
+}
+
+bool cOmx::GetBufferDuration(int &audio, int &video)
+{
+	int64_t stc = GetSTC();
+	if (stc == OMX_INVALID_PTS)
 	{
-		audio += m_usedAudioBuffers[i];
-		video += m_usedVideoBuffers[i];
+		audio = video = 0;
+		return false;
 	}
-	audio = audio * 100 / BUFFERSTAT_FILTER_SIZE / OMX_AUDIO_BUFFERS;
-	video = video * 100 / BUFFERSTAT_FILTER_SIZE / OMX_VIDEO_BUFFERS;
+
+	m_audioMutex.Lock();
+	int64_t audioPts = m_audioPts->Latest();
+	m_audioMutex.Unlock();
+
+	m_videoMutex.Lock();
+	int64_t videoPts = m_videoPts->Latest();
+	m_videoMutex.Unlock();
+
+	audio = audioPts != OMX_INVALID_PTS ?
+			std::max(0, (int)((audioPts - stc) / 90)) : 0;
+	video = videoPts != OMX_INVALID_PTS ?
+			std::max(0, (int)((videoPts - stc) / 90)) : 0;
+	return true;
 }
 
-void cOmx::HandlePortBufferEmptied(eOmxComponent component)
+void cOmx::GetInputBufferDuration(int &audio, int &video)
 {
-	Lock();
+	m_audioMutex.Lock();
+	int64_t audioPts = m_audioPts->Oldest();
+	audio = audioPts != OMX_INVALID_PTS ?
+			std::max(0, (int)((m_audioPts->Latest() - audioPts) / 90)) : 0;
+	m_audioMutex.Unlock();
+
+	m_videoMutex.Lock();
+	int64_t videoPts = m_videoPts->Oldest();
+	video = videoPts != OMX_INVALID_PTS ?
+			std::max(0, (int)((m_videoPts->Latest() - videoPts) / 90)) : 0;
+	m_videoMutex.Unlock();
+}
 
+void cOmx::HandlePortBufferEmptied(eOmxComponent component)
+{
 	switch (component)
 	{
 	case eVideoDecoder:
-		m_usedVideoBuffers[0]--;
+		m_videoMutex.Lock();
+		m_videoBufferStat->Dec();
+		m_videoPts->Pop();
+		m_videoMutex.Unlock();
 		break;
 
 	case eAudioRender:
-		m_usedAudioBuffers[0]--;
+		m_audioMutex.Lock();
+		m_audioBufferStat->Dec();
+		m_audioPts->Pop();
+		m_audioMutex.Unlock();
 		break;
 
 	default:
 		ELOG("HandlePortBufferEmptied: invalid component!");
 		break;
 	}
-	Unlock();
 }
 
 void cOmx::HandlePortSettingsChanged(unsigned int portId)
 {
+	// audio is independent of the video ports, remember the underruns to
+	// see if audio kept flowing while video has been reconfigured
+	m_audioMutex.Lock();
+	m_videoReconfigUnderruns = m_audioUnderruns;
+	m_audioMutex.Unlock();
+
+	// the video input isn't touched here, so data can still be written to
+	// the decoder while a previous tunnel setup is being completed
 	Lock();
 	DBG("HandlePortSettingsChanged(%d)", portId);
+	cVideoFrameFormat format;
+
+	// complete a previous setup before starting the next one
+	FinishTunnelSetup();
 
 	switch (portId)
 	{
 	case 191:
-		if (ilclient_setup_tunnel(&m_tun[eVideoFxToVideoScheduler], 0, 0) != 0)
-			ELOG("failed to setup up tunnel from video fx to scheduler!");
-		if (ilclient_change_component_state(m_comp[eVideoScheduler], OMX_StateExecuting) != 0)
-			ELOG("failed to enable video scheduler!");
+		StartTunnelSetup(eVideoFxToVideoScheduler, eVideoScheduler);
 		break;
 
 	case 131:
@@ -326,11 +823,11 @@ void cOmx::HandlePortSettingsChanged(unsigned int portId)
 				&interlace) != OMX_ErrorNone)
 			ELOG("failed to get video decoder interlace config!");
 
-		m_videoFrameFormat.width = portdef.format.video.nFrameWidth;
-		m_videoFrameFormat.height = portdef.format.video.nFrameHeight;
-		m_videoFrameFormat.pixelWidth = pixelAspect.nX;
-		m_videoFrameFormat.pixelHeight = pixelAspect.nY;
-		m_videoFrameFormat.scanMode =
+		format.width = portdef.format.video.nFrameWidth;
+		format.height = portdef.format.video.nFrameHeight;
+		format.pixelWidth = pixelAspect.nX;
+		format.pixelHeight = pixelAspect.nY;
+		format.scanMode =
 				interlace.eMode == OMX_InterlaceProgressive ? cScanMode::eProgressive :
 				interlace.eMode == OMX_InterlaceFieldSingleUpperFirst ? cScanMode::eTopFieldFirst :
 				interlace.eMode == OMX_InterlaceFieldSingleLowerFirst ? cScanMode::eBottomFieldFirst :
@@ -340,111 +837,274 @@ void cOmx::HandlePortSettingsChanged(unsigned int portId)
 
 		// discard 4 least significant bits, since there might be some deviation
 		// due to jitter in time stamps
-		m_videoFrameFormat.frameRate = ALIGN_UP(
+		format.frameRate = ALIGN_UP(
 				portdef.format.video.xFramerate & 0xfffffff0, 1 << 16) >> 16;
 
 		// workaround for progressive streams detected as interlaced video by
 		// the decoder due to missing SEI parsing
 		// see: https://github.com/raspberrypi/firmware/issues/283
 		// update: with FW from 2015/01/18 this is not necessary anymore
-		if (m_videoFrameFormat.Interlaced() && m_videoFrameFormat.frameRate >= 50)
+		if (format.Interlaced() && format.frameRate >= 50)
 		{
 			DLOG("%di looks implausible, you should use a recent firmware...",
-					m_videoFrameFormat.frameRate * 2);
+					format.frameRate * 2);
 			//m_videoFormat.interlaced = false;
 		}
 
-		if (m_videoFrameFormat.Interlaced())
-			m_videoFrameFormat.frameRate = m_videoFrameFormat.frameRate * 2;
+		if (format.Interlaced())
+			format.frameRate = format.frameRate * 2;
 
-		if (m_onStreamStart)
-			m_onStreamStart(m_onStreamStartData);
+		// display and video fx have already been set up if the format has
+		// been preset from the stream headers
+		if (format != m_videoFrameFormat)
+		{
+			m_videoFrameFormat = format;
+			if (m_onStreamStart)
+				m_onStreamStart(m_onStreamStartData);
+		}
+		else
+			DBG("video format matches preset");
 
-		OMX_CONFIG_IMAGEFILTERPARAMSTYPE filterparam;
-		OMX_INIT_STRUCT(filterparam);
-		filterparam.nPortIndex = 191;
-		filterparam.eImageFilter = OMX_ImageFilterNone;
+		SetVideoFxFilter();
+		StartTunnelSetup(eVideoDecoderToVideoFx, eVideoFx);
+		break;
 
-		OMX_PARAM_U32TYPE extraBuffers;
-		OMX_INIT_STRUCT(extraBuffers);
-		extraBuffers.nPortIndex = 130;
+	case 11:
+		StartTunnelSetup(eVideoSchedulerToVideoRender, eVideoRender);
+		break;
+	}
 
-		if (cRpiDisplay::IsProgressive() && m_videoFrameFormat.Interlaced())
-		{
-			bool fastDeinterlace = !cRpiSetup::UseAdvancedDeinterlacer(
-					portdef.format.video.nFrameWidth,
-					portdef.format.video.nFrameHeight);
+	Unlock();
+	m_videoReconfigTime = cTimeMs::Now();
+}
+
+void cOmx::HandleVideoFrameFormatPreset(void)
+{
+	DBG("HandleVideoFrameFormatPreset()");
+
+	// switch display mode while the decoder is still busy with the first
+	// frames and set up video fx according to the new display mode. the
+	// callback is invoked with the lock held, as on port settings changes
+	Lock();
+	if (m_onStreamStart)
+		m_onStreamStart(m_onStreamStartData);
+
+	SetVideoFxFilter();
+	Unlock();
+}
 
-			DBG("using %s deinterlacer", fastDeinterlace ? "fast" : "advanced");
+// the video tunnels are set up when the source's output port has been
+// configured, which is signaled by a port settings changed event. the tunnel
+// setup and the state change of the sink component are executed as separate
+// steps, the latter without waiting for its completion, so the event thread
+// doesn't block on the whole chain and the locks are released in between
+
+void cOmx::StartTunnelSetup(eOmxTunnel tunnel, eOmxComponent sink)
+{
+	m_tunnelSetupTunnel = tunnel;
+	m_tunnelSetupComponent = sink;
+	m_tunnelSetupStep = eTunnelSetupConnect;
+	m_tunnelSetupTime = m_tunnelSetupStepTime = NowUs();
+	m_portEvents->Signal();
+}
+
+// executes the next step, or all remaining steps if wait is set. returns
+// true as long as the setup has not been completed
+
+bool cOmx::ContinueTunnelSetup(bool wait)
+{
+	Lock();
+
+	// a state change which has timed out may still complete later, remove
+	// its event so it doesn't stay in ilclient's event list
+	if (m_tunnelSetupLateComponent != eNumComponents &&
+			ilclient_remove_event(m_comp[m_tunnelSetupLateComponent],
+			OMX_EventCmdComplete, OMX_CommandStateSet, 0,
+			OMX_StateExecuting, 0) == 0)
+	{
+		DLOG("%s enabled after timeout", compStr(m_tunnelSetupLateComponent));
+		m_tunnelSetupLateComponent = eNumComponents;
+	}
 
-			filterparam.nNumParams = 4;
-			filterparam.nParams[0] = 3;
-			filterparam.nParams[1] = 0; // default frame interval
-			filterparam.nParams[2] = 0; // half framerate
-			filterparam.nParams[3] = 1; // use qpus
+	do
+	{
+		COMPONENT_T *comp = m_comp[m_tunnelSetupComponent];
+		const char *name = compStr(m_tunnelSetupComponent);
+		uint64_t now = NowUs();
 
-			filterparam.eImageFilter = fastDeinterlace ?
-					OMX_ImageFilterDeInterlaceFast :
-					OMX_ImageFilterDeInterlaceAdvanced;
+		switch (m_tunnelSetupStep)
+		{
+		case eTunnelSetupConnect:
+			if (ilclient_setup_tunnel(&m_tun[m_tunnelSetupTunnel], 0, 0) != 0)
+				ELOG("failed to setup up tunnel to %s!", name);
+
+			now = NowUs();
+			DBG("tunnel to %s set up in %dus", name,
+					(int)(now - m_tunnelSetupStepTime));
+			m_tunnelSetupStep = eTunnelSetupStart;
+			m_tunnelSetupStepTime = now;
+			break;
+
+		case eTunnelSetupStart:
+			// a late completion would be taken for this state change
+			if (m_tunnelSetupLateComponent == m_tunnelSetupComponent)
+				m_tunnelSetupLateComponent = eNumComponents;
+
+			if (OMX_SendCommand(ILC_GET_HANDLE(comp), OMX_CommandStateSet,
+					OMX_StateExecuting, NULL) != OMX_ErrorNone)
+			{
+				ELOG("failed to enable %s!", name);
+				m_tunnelSetupStep = eTunnelSetupIdle;
+			}
+			else
+				m_tunnelSetupStep = eTunnelSetupWaitStarted;
+			break;
+
+		case eTunnelSetupWaitStarted:
+			if (wait ? ilclient_wait_for_command_complete(comp,
+					OMX_CommandStateSet, OMX_StateExecuting) == 0 :
+					ilclient_remove_event(comp, OMX_EventCmdComplete,
+					OMX_CommandStateSet, 0, OMX_StateExecuting, 0) == 0)
+			{
+				now = NowUs();
+				DBG("%s enabled in %dus, tunnel setup took %dus", name,
+						(int)(now - m_tunnelSetupStepTime),
+						(int)(now - m_tunnelSetupTime));
+				m_tunnelSetupStep = eTunnelSetupIdle;
+
+				// the scheduler has passed the first picture to the render,
+				// signaled to the event thread if completed by another one
+				if (m_tunnelSetupComponent == eVideoRender)
+				{
+					m_videoRenderStarted = true;
+					m_portEvents->Signal();
+				}
+			}
+			else if (wait || ilclient_remove_event(comp, OMX_EventError,
+					0, 1, 0, 1) == 0)
+			{
+				ELOG("failed to enable %s!", name);
+				ilclient_remove_event(comp, OMX_EventError, 0, 1, 0, 1);
+				m_tunnelSetupStep = eTunnelSetupIdle;
+			}
+			else if (now - m_tunnelSetupStepTime >
+					OMX_TUNNEL_SETUP_TIMEOUT * 1000)
+			{
+				ELOG("timeout while enabling %s!", name);
+				m_tunnelSetupLateComponent = m_tunnelSetupComponent;
+				m_tunnelSetupStep = eTunnelSetupIdle;
+			}
+			break;
 
-			if (fastDeinterlace)
-				extraBuffers.nU32 = -2;
+		default:
+			break;
 		}
-		if (OMX_SetConfig(ILC_GET_HANDLE(m_comp[eVideoFx]),
-				OMX_IndexConfigCommonImageFilterParameters, &filterparam) != OMX_ErrorNone)
-			ELOG("failed to set deinterlacing paramaters!");
+	}
+	while (wait && m_tunnelSetupStep != eTunnelSetupIdle);
+
+	bool pending = m_tunnelSetupStep != eTunnelSetupIdle;
+	Unlock();
+	return pending;
+}
+
+void cOmx::FinishTunnelSetup(void)
+{
+	ContinueTunnelSetup(true);
+}
 
-		if (OMX_SetParameter(ILC_GET_HANDLE(m_comp[eVideoFx]),
-				OMX_IndexParamBrcmExtraBuffers, &extraBuffers) != OMX_ErrorNone)
-			ELOG("failed to set video fx extra buffers!");
+void cOmx::SetVideoFxFilter(void)
+{
+	OMX_CONFIG_IMAGEFILTERPARAMSTYPE filterparam;
+	OMX_INIT_STRUCT(filterparam);
+	filterparam.nPortIndex = 191;
+	filterparam.eImageFilter = OMX_ImageFilterNone;
 
-		if (ilclient_setup_tunnel(&m_tun[eVideoDecoderToVideoFx], 0, 0) != 0)
-			ELOG("failed to setup up tunnel from video decoder to fx!");
-		if (ilclient_change_component_state(m_comp[eVideoFx], OMX_StateExecuting) != 0)
-			ELOG("failed to enable video fx!");
+	OMX_PARAM_U32TYPE extraBuffers;
+	OMX_INIT_STRUCT(extraBuffers);
+	extraBuffers.nPortIndex = 130;
 
-		break;
+	if (cRpiDisplay::IsProgressive() && m_videoFrameFormat.Interlaced())
+	{
+		bool fastDeinterlace = !cRpiSetup::UseAdvancedDeinterlacer(
+				m_videoFrameFormat.width, m_videoFrameFormat.height);
 
-	case 11:
-		if (ilclient_setup_tunnel(&m_tun[eVideoSchedulerToVideoRender], 0, 0) != 0)
-			ELOG("failed to setup up tunnel from scheduler to render!");
-		if (ilclient_change_component_state(m_comp[eVideoRender], OMX_StateExecuting) != 0)
-			ELOG("failed to enable video render!");
-		break;
+		filterparam.nNumParams = 4;
+		filterparam.nParams[0] = 3;
+		filterparam.nParams[1] = 0; // default frame interval
+		filterparam.nParams[2] = 0; // half framerate
+		filterparam.nParams[3] = 1; // use qpus
+
+		filterparam.eImageFilter = fastDeinterlace ?
+				OMX_ImageFilterDeInterlaceFast :
+				OMX_ImageFilterDeInterlaceAdvanced;
+
+		if (fastDeinterlace)
+			extraBuffers.nU32 = -2;
 	}
 
+	if (filterparam.eImageFilter == m_videoFxFilter)
+		return;
+
+	DBG("using %s", filterparam.eImageFilter == OMX_ImageFilterNone ?
+			"no deinterlacer" :
+			filterparam.eImageFilter == OMX_ImageFilterDeInterlaceFast ?
+			"fast deinterlacer" : "advanced deinterlacer");
+
+	if (OMX_SetConfig(ILC_GET_HANDLE(m_comp[eVideoFx]),
+			OMX_IndexConfigCommonImageFilterParameters, &filterparam) != OMX_ErrorNone)
+		ELOG("failed to set deinterlacing paramaters!");
+
+	if (OMX_SetParameter(ILC_GET_HANDLE(m_comp[eVideoFx]),
+			OMX_IndexParamBrcmExtraBuffers, &extraBuffers) != OMX_ErrorNone)
+		ELOG("failed to set video fx extra buffers!");
+
+	m_videoFxFilter = filterparam.eImageFilter;
+}
+
+void cOmx::PresetVideoFrameFormat(const cVideoFrameFormat &format)
+{
+	Lock();
+
+	// ignore preset once the decoder has reported the actual format
+	if (!m_videoFrameFormat.width && format.width)
+	{
+		m_videoFrameFormat = format;
+		m_videoFrameFormatPreset = true;
+		m_portEvents->Signal();
+	}
 	Unlock();
 }
 
 void cOmx::OnBufferEmpty(void *instance, COMPONENT_T *comp)
 {
 	cOmx* omx = static_cast <cOmx*> (instance);
-	omx->m_portEvents->Add(
-			new cOmxEvents::Event(cOmxEvents::eBufferEmptied,
-					comp == omx->m_comp[eVideoDecoder] ? eVideoDecoder :
-					comp == omx->m_comp[eAudioRender] ? eAudioRender :
-							eInvalidComponent));
+	eOmxComponent component =
+			comp == omx->m_comp[eVideoDecoder] ? eVideoDecoder :
+			comp == omx->m_comp[eAudioRender] ? eAudioRender :
+					eInvalidComponent;
+
+	if (!omx->m_portEvents->Add(cOmxEvents::eBufferEmptied, component) &&
+			component != eInvalidComponent)
+		__atomic_fetch_add(&omx->m_lostBuffersEmptied[component], 1,
+				__ATOMIC_RELAXED);
 }
 
 void cOmx::OnPortSettingsChanged(void *instance, COMPONENT_T *comp, OMX_U32 data)
 {
 	cOmx* omx = static_cast <cOmx*> (instance);
-	omx->m_portEvents->Add(
-			new cOmxEvents::Event(cOmxEvents::ePortSettingsChanged, data));
+	omx->m_portEvents->Add(cOmxEvents::ePortSettingsChanged, data);
 }
 
 void cOmx::OnConfigChanged(void *instance, COMPONENT_T *comp, OMX_U32 data)
 {
 	cOmx* omx = static_cast <cOmx*> (instance);
-	omx->m_portEvents->Add(
-			new cOmxEvents::Event(cOmxEvents::eConfigChanged, data));
+	omx->m_portEvents->Add(cOmxEvents::eConfigChanged, data);
 }
 
 void cOmx::OnEndOfStream(void *instance, COMPONENT_T *comp, OMX_U32 data)
 {
 	cOmx* omx = static_cast <cOmx*> (instance);
-	omx->m_portEvents->Add(
-			new cOmxEvents::Event(cOmxEvents::eEndOfStream, data));
+	omx->m_portEvents->Add(cOmxEvents::eEndOfStream, data);
 }
 
 void cOmx::OnError(void *instance, COMPONENT_T *comp, OMX_U32 data)
@@ -456,13 +1116,45 @@ void cOmx::OnError(void *instance, COMPONENT_T *comp, OMX_U32 data)
 cOmx::cOmx() :
 	cThread(),
 	m_client(NULL),
+	m_videoFxFilter(OMX_ImageFilterMax),
 	m_setAudioStartTime(false),
 	m_setVideoStartTime(false),
 	m_setVideoDiscontinuity(false),
+	m_videoFrameFormatPreset(false),
+	m_videoRenderStarted(false),
 	m_spareAudioBuffers(0),
 	m_spareVideoBuffers(0),
+	m_audioPts(new cOmxPtsQueue()),
+	m_videoPts(new cOmxPtsQueue()),
+	m_audioBufferPool(new cOmxBufferPool(OMX_AUDIO_BUFFERS)),
+	m_videoBufferPool(new cOmxBufferPool(OMX_VIDEO_BUFFERS)),
+	m_audioBufferStat(new cOmxBufferStat(OMX_AUDIO_BUFFERS)),
+	m_videoBufferStat(new cOmxBufferStat(OMX_VIDEO_BUFFERS)),
+	m_videoBytes(0),
+	m_videoBytesTime(0),
+	m_videoPeakRate(0),
+	m_tunnelSetupStep(eTunnelSetupIdle),
+	m_tunnelSetupTunnel(eVideoDecoderToVideoFx),
+	m_tunnelSetupComponent(eVideoFx),
+	m_tunnelSetupTime(0),
+	m_tunnelSetupStepTime(0),
+	m_tunnelSetupLateComponent(eNumComponents),
+	m_audioMutex("omx audio"),
+	m_videoMutex("omx video"),
+	m_audioUnderruns(0),
+	m_audioRunDry(false),
+	m_videoReconfigUnderruns(0),
+	m_videoReconfigTime(0),
 	m_clockReference(eClockRefNone),
 	m_clockScale(0),
+	m_stcMutex("omx stc"),
+	m_stcCache(OMX_INVALID_PTS),
+	m_stcCacheTime(0),
+	m_stcCacheAdvancing(false),
+	m_stcCalls(0),
+	m_stcReads(0),
+	m_stcReadUs(0),
+	m_stcStatTime(0),
 	m_portEvents(new cOmxEvents()),
 	m_handlePortEvents(false),
 	m_onBufferStall(0),
@@ -470,10 +1162,13 @@ cOmx::cOmx() :
 	m_onEndOfStream(0),
 	m_onEndOfStreamData(0),
 	m_onStreamStart(0),
-	m_onStreamStartData(0)
+	m_onStreamStartData(0),
+	m_onFirstPicture(0),
+	m_onFirstPictureData(0)
 {
 	memset(m_tun, 0, sizeof(m_tun));
 	memset(m_comp, 0, sizeof(m_comp));
+	memset(m_lostBuffersEmptied, 0, sizeof(m_lostBuffersEmptied));
 
 	m_videoFrameFormat.width = 0;
 	m_videoFrameFormat.height = 0;
@@ -484,6 +1179,12 @@ cOmx::cOmx() :
 cOmx::~cOmx()
 {
 	delete m_portEvents;
+	delete m_audioPts;
+	delete m_videoPts;
+	delete m_audioBufferPool;
+	delete m_videoBufferPool;
+	delete m_audioBufferStat;
+	delete m_videoBufferStat;
 }
 
 int cOmx::Init(int display, int layer)
@@ -578,7 +1279,8 @@ int cOmx::Init(int display, int layer)
 int cOmx::DeInit(void)
 {
 	Cancel(-1);
-	m_portEvents->Add(0);
+	m_portEvents->Signal();
+	FinishTunnelSetup();
 
 	for (int i = 0; i < eNumTunnels; i++)
 		ilclient_disable_tunnel(&m_tun[i]);
@@ -613,6 +1315,12 @@ void cOmx::SetStreamStartCallback(void (*onStreamStart)(void*), void* data)
 	m_onStreamStartData = data;
 }
 
+void cOmx::SetFirstPictureCallback(void (*onFirstPicture)(void*), void* data)
+{
+	m_onFirstPicture = onFirstPicture;
+	m_onFirstPictureData = data;
+}
+
 OMX_TICKS cOmx::ToOmxTicks(int64_t val)
 {
 	OMX_TICKS ticks;
@@ -660,6 +1368,68 @@ int64_t cOmx::GetSTC(void)
 	return stc;
 }
 
+// STC interpolated from the last read of the clock's media time with the
+// current clock scale. the error is bounded by the drift between media clock
+// and system clock within OMX_STC_CACHE_INTERVAL plus 1ms resolution, there is
+// no interpolation if the clock has not advanced between the last two reads
+
+int64_t cOmx::GetCachedSTC(void)
+{
+	uint64_t now = cTimeMs::Now();
+	int64_t stc = OMX_INVALID_PTS;
+
+	m_stcMutex.Lock();
+	m_stcCalls++;
+	if (m_stcCache != OMX_INVALID_PTS &&
+			now - m_stcCacheTime < OMX_STC_CACHE_INTERVAL)
+		stc = m_stcCache + (m_stcCacheAdvancing ?
+				(int64_t)(now - m_stcCacheTime) * 90 * m_clockScale / 65536 : 0);
+	m_stcMutex.Unlock();
+
+	if (stc != OMX_INVALID_PTS)
+		return stc;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	stc = GetSTC();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	// the clock is known to advance only after two differing reads
+	m_stcMutex.Lock();
+	m_stcCacheAdvancing = m_stcCache != OMX_INVALID_PTS &&
+			stc != OMX_INVALID_PTS && stc != m_stcCache;
+	m_stcCache = stc;
+	m_stcCacheTime = now;
+	m_stcReads++;
+	m_stcReadUs += (end.tv_sec - start.tv_sec) * 1000000LL +
+			(end.tv_nsec - start.tv_nsec) / 1000;
+
+	if (now - m_stcStatTime > 10000)
+	{
+		if (m_stcStatTime)
+			DBG("STC: %llu calls/s, %llu clock reads/s, avg read %lluus",
+					m_stcCalls * 1000 / (now - m_stcStatTime),
+					m_stcReads * 1000 / (now - m_stcStatTime),
+					m_stcReadUs / m_stcReads);
+
+		m_stcCalls = 0;
+		m_stcReads = 0;
+		m_stcReadUs = 0;
+		m_stcStatTime = now;
+	}
+	m_stcMutex.Unlock();
+
+	return stc;
+}
+
+void cOmx::InvalidateCachedSTC(void)
+{
+	m_stcMutex.Lock();
+	m_stcCache = OMX_INVALID_PTS;
+	m_stcCacheAdvancing = false;
+	m_stcMutex.Unlock();
+}
+
 bool cOmx::IsClockRunning(void)
 {
 	OMX_TIME_CONFIG_CLOCKSTATETYPE cstate;
@@ -690,19 +1460,25 @@ void cOmx::StartClock(bool waitForVideo, bool waitForAudio, int preRollMs)
 	if (waitForVideo)
 	{
 		cstate.eState = OMX_TIME_ClockStateWaitingForStartTime;
+		m_videoMutex.Lock();
 		m_setVideoStartTime = true;
+		m_videoMutex.Unlock();
 		cstate.nWaitMask |= OMX_CLOCKPORT0;
 	}
 	if (waitForAudio)
 	{
 		cstate.eState = OMX_TIME_ClockStateWaitingForStartTime;
+		m_audioMutex.Lock();
 		m_setAudioStartTime = true;
+		m_audioMutex.Unlock();
 		cstate.nWaitMask |= OMX_CLOCKPORT1;
 	}
 
 	if (OMX_SetConfig(ILC_GET_HANDLE(m_comp[eClock]),
 			OMX_IndexConfigTimeClockState, &cstate) != OMX_ErrorNone)
 		ELOG("failed to start clock!");
+
+	InvalidateCachedSTC();
 }
 
 void cOmx::StopClock(void)
@@ -715,12 +1491,17 @@ void cOmx::StopClock(void)
 	if (OMX_SetConfig(ILC_GET_HANDLE(m_comp[eClock]),
 			OMX_IndexConfigTimeClockState, &cstate) != OMX_ErrorNone)
 		ELOG("failed to stop clock!");
+
+	InvalidateCachedSTC();
 }
 
 void cOmx::SetClockScale(OMX_S32 scale)
 {
 	if (scale != m_clockScale)
 	{
+		// cached STC is interpolated with the current scale
+		InvalidateCachedSTC();
+
 		OMX_TIME_CONFIG_SCALETYPE scaleType;
 		OMX_INIT_STRUCT(scaleType);
 		scaleType.xScale = scale;
@@ -735,6 +1516,9 @@ void cOmx::SetClockScale(OMX_S32 scale)
 
 void cOmx::ResetClock(void)
 {
+	// complete a pending tunnel setup before the clock is touched
+	FinishTunnelSetup();
+
 	OMX_TIME_CONFIG_TIMESTAMPTYPE timeStamp;
 	OMX_INIT_STRUCT(timeStamp);
 
@@ -755,6 +1539,7 @@ void cOmx::ResetClock(void)
 				!= OMX_ErrorNone)
 			ELOG("failed to set current video reference time!");
 	}
+	InvalidateCachedSTC();
 }
 
 unsigned int cOmx::GetAudioLatency(void)
@@ -778,6 +1563,8 @@ void cOmx::SetClockReference(eClockReference clockReference)
 {
 	if (m_clockReference != clockReference)
 	{
+		FinishTunnelSetup();
+
 		OMX_TIME_CONFIG_ACTIVEREFCLOCKTYPE refClock;
 		OMX_INIT_STRUCT(refClock);
 		refClock.eClock =
@@ -909,10 +1696,20 @@ void cOmx::SetMute(bool mute)
 void cOmx::StopVideo(void)
 {
 	Lock();
+	m_videoMutex.Lock();
+	FinishTunnelSetup();
+
+	if (m_videoBufferStat->Exhaustions())
+		DLOG("video buffers exhausted %d times, %d buffers, peak %dkbit/s",
+				m_videoBufferStat->Exhaustions(), m_videoBufferStat->Buffers(),
+				m_videoPeakRate * 8 / 1000);
+
+	// keep the stream's properties to size the next stream's buffers
+	m_lastVideoFrameFormat = m_videoFrameFormat;
 
 	// disable port buffers and allow video decoder to reconfig
 	ilclient_disable_port_buffers(m_comp[eVideoDecoder], 130,
-			m_spareVideoBuffers, NULL, NULL);
+			m_spareVideoBuffers, cOmxBufferPool::Free, m_videoBufferPool);
 
 	m_spareVideoBuffers = 0;
 	m_handlePortEvents = false;
@@ -921,6 +1718,9 @@ void cOmx::StopVideo(void)
 	m_videoFrameFormat.height = 0;
 	m_videoFrameFormat.frameRate = 0;
 	m_videoFrameFormat.scanMode = cScanMode::eProgressive;
+	m_videoFrameFormat.pixelWidth = 0;
+	m_videoFrameFormat.pixelHeight = 0;
+	m_videoFxFilter = OMX_ImageFilterMax;
 
 	// put video decoder into idle
 	ilclient_change_component_state(m_comp[eVideoDecoder], OMX_StateIdle);
@@ -942,21 +1742,29 @@ void cOmx::StopVideo(void)
 	ilclient_disable_tunnel(&m_tun[eVideoSchedulerToVideoRender]);
 	ilclient_change_component_state(m_comp[eVideoRender], OMX_StateIdle);
 
+	m_videoMutex.Unlock();
 	Unlock();
 }
 
 void cOmx::StopAudio(void)
 {
 	Lock();
+	m_audioMutex.Lock();
+
+	if (m_audioBufferStat->Exhaustions())
+		DLOG("audio buffers exhausted %d times, %d buffers",
+				m_audioBufferStat->Exhaustions(), m_audioBufferStat->Buffers());
 
 	// put audio render onto idle
 	ilclient_flush_tunnels(&m_tun[eClockToAudioRender], 1);
 	ilclient_disable_tunnel(&m_tun[eClockToAudioRender]);
 	ilclient_change_component_state(m_comp[eAudioRender], OMX_StateIdle);
 	ilclient_disable_port_buffers(m_comp[eAudioRender], 100,
-			m_spareAudioBuffers, NULL, NULL);
+			m_spareAudioBuffers, cOmxBufferPool::Free, m_audioBufferPool);
 
 	m_spareAudioBuffers = 0;
+	m_audioPts->Reset();
+	m_audioMutex.Unlock();
 	Unlock();
 }
 
@@ -973,6 +1781,7 @@ void cOmx::SetVideoErrorConcealment(bool startWithValidFrame)
 void cOmx::FlushAudio(void)
 {
 	Lock();
+	m_audioMutex.Lock();
 
 	if (OMX_SendCommand(ILC_GET_HANDLE(m_comp[eAudioRender]), OMX_CommandFlush, 100, NULL) != OMX_ErrorNone)
 		ELOG("failed to flush audio render!");
@@ -982,12 +1791,16 @@ void cOmx::FlushAudio(void)
 		VCOS_EVENT_FLAGS_SUSPEND);
 
 	ilclient_flush_tunnels(&m_tun[eClockToAudioRender], 1);
+	m_audioPts->Invalidate();
+	m_audioMutex.Unlock();
 	Unlock();
 }
 
 void cOmx::FlushVideo(bool flushRender)
 {
 	Lock();
+	FinishTunnelSetup();
+	m_videoMutex.Lock();
 
 	if (OMX_SendCommand(ILC_GET_HANDLE(m_comp[eVideoDecoder]), OMX_CommandFlush, 130, NULL) != OMX_ErrorNone)
 		ELOG("failed to flush video decoder!");
@@ -1005,12 +1818,22 @@ void cOmx::FlushVideo(bool flushRender)
 	ilclient_flush_tunnels(&m_tun[eClockToVideoScheduler], 1);
 
 	m_setVideoDiscontinuity = true;
+	m_videoPts->Invalidate();
+	m_videoMutex.Unlock();
 	Unlock();
 }
 
+void cOmx::SetVideoDiscontinuity(void)
+{
+	m_videoMutex.Lock();
+	m_setVideoDiscontinuity = true;
+	m_videoMutex.Unlock();
+}
+
 int cOmx::SetVideoCodec(cVideoCodec::eCodec codec)
 {
 	Lock();
+	m_videoMutex.Lock();
 
 	if (ilclient_change_component_state(m_comp[eVideoDecoder], OMX_StateIdle) != 0)
 		ELOG("failed to set video decoder to idle state!");
@@ -1035,10 +1858,24 @@ int cOmx::SetVideoCodec(cVideoCodec::eCodec codec)
 			OMX_IndexParamPortDefinition, &param) != OMX_ErrorNone)
 		ELOG("failed to get video decoder port parameters!");
 
+	// a format left from the previous stream would be taken for the new
+	// one and make PresetVideoFrameFormat() ignore the new stream's headers
+	if (m_videoFrameFormat.width)
+		m_lastVideoFrameFormat = m_videoFrameFormat;
+
+	m_videoFrameFormat = cVideoFrameFormat();
+	m_videoFrameFormatPreset = false;
+
+	int buffers = VideoBuffers(codec);
 	param.nBufferSize = OMX_VIDEO_BUFFERSIZE;
-	param.nBufferCountActual = OMX_VIDEO_BUFFERS;
-	for (int i = 0; i < BUFFERSTAT_FILTER_SIZE; i++)
-		m_usedVideoBuffers[i] = 0;
+	param.nBufferCountActual = buffers;
+	m_videoBufferPool->SetCount(buffers);
+	m_videoBufferStat->Reset(buffers);
+	m_videoPts->Reset();
+
+	m_videoPeakRate = 0;
+	m_videoBytes = 0;
+	m_videoBytesTime = 0;
 
 	if (OMX_SetParameter(ILC_GET_HANDLE(m_comp[eVideoDecoder]),
 			OMX_IndexParamPortDefinition, &param) != OMX_ErrorNone)
@@ -1051,7 +1888,9 @@ int cOmx::SetVideoCodec(cVideoCodec::eCodec codec)
 	// update: with FW from 2014/02/04 this is not necessary anymore
 	//SetVideoDecoderExtraBuffers(3);
 
-	if (ilclient_enable_port_buffers(m_comp[eVideoDecoder], 130, NULL, NULL, NULL) != 0)
+	if (ilclient_enable_port_buffers(m_comp[eVideoDecoder], 130,
+			cOmxBufferPool::Malloc, cOmxBufferPool::Free,
+			m_videoBufferPool) != 0)
 		ELOG("failed to enable port buffer on video decoder!");
 
 	if (ilclient_change_component_state(m_comp[eVideoDecoder], OMX_StateExecuting) != 0)
@@ -1063,10 +1902,39 @@ int cOmx::SetVideoCodec(cVideoCodec::eCodec codec)
 
 	m_handlePortEvents = true;
 
+	m_videoMutex.Unlock();
 	Unlock();
 	return 0;
 }
 
+// the video format isn't known before the decoder has been set up, so the
+// number of buffers is derived from the codec and the previous stream
+
+int cOmx::VideoBuffers(cVideoCodec::eCodec codec)
+{
+	int buffers = codec == cVideoCodec::eMPEG2 ?
+			OMX_VIDEO_MIN_BUFFERS : OMX_VIDEO_BUFFERS;
+
+	// UHD-like streams
+	if (m_lastVideoFrameFormat.height > 1088)
+		buffers *= 2;
+
+	// at least one buffer is used per frame or field, the frame rate of
+	// interlaced streams is already given in fields
+	buffers = std::max(buffers, m_lastVideoFrameFormat.frameRate *
+			OMX_VIDEO_BUFFER_DURATION / 1000);
+	buffers = std::max(buffers, (int)((int64_t)m_videoPeakRate *
+			OMX_VIDEO_BUFFER_DURATION / 1000 / OMX_VIDEO_BUFFERSIZE));
+	buffers = std::min(buffers, OMX_VIDEO_MAX_BUFFERS);
+
+	DLOG("using %d video buffers for %s (%dx%d@%d, %dkbit/s before)",
+			buffers, cVideoCodec::Str(codec),
+			m_lastVideoFrameFormat.width, m_lastVideoFrameFormat.height,
+			m_lastVideoFrameFormat.frameRate, m_videoPeakRate * 8 / 1000);
+
+	return buffers;
+}
+
 void cOmx::SetVideoDecoderExtraBuffers(int extraBuffers)
 {
 	OMX_PARAM_U32TYPE u32;
@@ -1082,6 +1950,7 @@ int cOmx::SetupAudioRender(cAudioCodec::eCodec outputFormat, int channels,
 		cRpiAudioPort::ePort audioPort, int samplingRate, int frameSize)
 {
 	Lock();
+	m_audioMutex.Lock();
 
 	OMX_AUDIO_PARAM_PORTFORMATTYPE format;
 	OMX_INIT_STRUCT(format);
@@ -1203,16 +2072,30 @@ int cOmx::SetupAudioRender(cAudioCodec::eCodec outputFormat, int channels,
 			OMX_IndexParamPortDefinition, &param) != OMX_ErrorNone)
 		ELOG("failed to get audio render port parameters!");
 
-	param.nBufferSize = OMX_AUDIO_BUFFERSIZE;
-	param.nBufferCountActual = OMX_AUDIO_BUFFERS;
-	for (int i = 0; i < BUFFERSTAT_FILTER_SIZE; i++)
-		m_usedAudioBuffers[i] = 0;
+	// pass-through DTS frames are as short as 512 samples, decoded frames are
+	// written in one piece and need to fit into a single buffer
+	int buffers = outputFormat == cAudioCodec::eDTS ?
+			OMX_AUDIO_MAX_BUFFERS : OMX_AUDIO_BUFFERS;
+	unsigned int bufferSize = outputFormat == cAudioCodec::ePCM ?
+			channels * 2 * OMX_AUDIO_MAX_FRAME_SAMPLES : frameSize;
+	bufferSize = std::max(bufferSize, (unsigned int)OMX_AUDIO_BUFFERSIZE);
+
+	DLOG("using %d audio buffers of %dkB for %s", buffers,
+			bufferSize / 1024, cAudioCodec::Str(outputFormat));
+
+	param.nBufferSize = bufferSize;
+	param.nBufferCountActual = buffers;
+	m_audioBufferPool->SetCount(buffers);
+	m_audioBufferStat->Reset(buffers);
+	m_audioPts->Reset();
 
 	if (OMX_SetParameter(ILC_GET_HANDLE(m_comp[eAudioRender]),
 			OMX_IndexParamPortDefinition, &param) != OMX_ErrorNone)
 		ELOG("failed to set audio render port parameters!");
 
-	if (ilclient_enable_port_buffers(m_comp[eAudioRender], 100, NULL, NULL, NULL) != 0)
+	if (ilclient_enable_port_buffers(m_comp[eAudioRender], 100,
+			cOmxBufferPool::Malloc, cOmxBufferPool::Free,
+			m_audioBufferPool) != 0)
 		ELOG("failed to enable port buffer on audio render!");
 
 	ilclient_change_component_state(m_comp[eAudioRender], OMX_StateExecuting);
@@ -1220,6 +2103,7 @@ int cOmx::SetupAudioRender(cAudioCodec::eCodec outputFormat, int channels,
 	if (ilclient_setup_tunnel(&m_tun[eClockToAudioRender], 0, 0) != 0)
 		ELOG("failed to setup up tunnel from clock to audio render!");
 
+	m_audioMutex.Unlock();
 	Unlock();
 	return 0;
 }
@@ -1291,7 +2175,7 @@ void cOmx::SetDisplay(int display, int layer)
 
 OMX_BUFFERHEADERTYPE* cOmx::GetAudioBuffer(int64_t pts)
 {
-	Lock();
+	m_audioMutex.Lock();
 	OMX_BUFFERHEADERTYPE* buf = 0;
 	if (m_spareAudioBuffers)
 	{
@@ -1304,7 +2188,9 @@ OMX_BUFFERHEADERTYPE* cOmx::GetAudioBuffer(int64_t pts)
 	{
 		buf = ilclient_get_input_buffer(m_comp[eAudioRender], 100, 0);
 		if (buf)
-			m_usedAudioBuffers[0]++;
+			m_audioBufferStat->Inc();
+		else
+			m_audioBufferStat->Exhausted();
 	}
 
 	if (buf)
@@ -1322,13 +2208,13 @@ OMX_BUFFERHEADERTYPE* cOmx::GetAudioBuffer(int64_t pts)
 		}
 		cOmx::PtsToTicks(pts, buf->nTimeStamp);
 	}
-	Unlock();
+	m_audioMutex.Unlock();
 	return buf;
 }
 
 OMX_BUFFERHEADERTYPE* cOmx::GetVideoBuffer(int64_t pts)
 {
-	Lock();
+	m_videoMutex.Lock();
 	OMX_BUFFERHEADERTYPE* buf = 0;
 	if (m_spareVideoBuffers)
 	{
@@ -1341,7 +2227,9 @@ OMX_BUFFERHEADERTYPE* cOmx::GetVideoBuffer(int64_t pts)
 	{
 		buf = ilclient_get_input_buffer(m_comp[eVideoDecoder], 130, 0);
 		if (buf)
-			m_usedVideoBuffers[0]++;
+			m_videoBufferStat->Inc();
+		else
+			m_videoBufferStat->Exhausted();
 	}
 
 	if (buf)
@@ -1364,7 +2252,7 @@ OMX_BUFFERHEADERTYPE* cOmx::GetVideoBuffer(int64_t pts)
 		}
 		cOmx::PtsToTicks(pts, buf->nTimeStamp);
 	}
-	Unlock();
+	m_videoMutex.Unlock();
 	return buf;
 }
 
@@ -1400,8 +2288,9 @@ bool cOmx::EmptyAudioBuffer(OMX_BUFFERHEADERTYPE *buf)
 	if (!buf)
 		return false;
 
-	Lock();
+	m_audioMutex.Lock();
 	bool ret = true;
+	bool discontinuity = false;
 #ifdef DEBUG_BUFFERS
 	DumpBuffer(buf, "A");
 #endif
@@ -1414,15 +2303,22 @@ bool cOmx::EmptyAudioBuffer(OMX_BUFFERHEADERTYPE *buf)
 		if (buf->nFlags & OMX_BUFFERFLAG_STARTTIME)
 			m_setAudioStartTime = true;
 
-		if (buf->nFlags & OMX_BUFFERFLAG_DISCONTINUITY)
-			m_setVideoDiscontinuity = true;
+		discontinuity = buf->nFlags & OMX_BUFFERFLAG_DISCONTINUITY;
 
 		buf->nFilledLen = 0;
 		buf->pAppPrivate = m_spareAudioBuffers;
 		m_spareAudioBuffers = buf;
 		ret = false;
 	}
-	Unlock();
+	else
+		m_audioPts->Push(buf->nFlags & OMX_BUFFERFLAG_TIME_UNKNOWN ?
+				OMX_INVALID_PTS : TicksToPts(buf->nTimeStamp));
+	m_audioMutex.Unlock();
+
+	// set after the audio lock has been released, see lock order in omx.h
+	if (discontinuity)
+		SetVideoDiscontinuity();
+
 	return ret;
 }
 
@@ -1431,7 +2327,7 @@ bool cOmx::EmptyVideoBuffer(OMX_BUFFERHEADERTYPE *buf)
 	if (!buf)
 		return false;
 
-	Lock();
+	m_videoMutex.Lock();
 	bool ret = true;
 #ifdef DEBUG_BUFFERS
 	DumpBuffer(buf, "V");
@@ -1450,6 +2346,13 @@ bool cOmx::EmptyVideoBuffer(OMX_BUFFERHEADERTYPE *buf)
 		m_spareVideoBuffers = buf;
 		ret = false;
 	}
-	Unlock();
+	else
+	{
+		m_videoPts->Push(buf->nFlags &
+				(OMX_BUFFERFLAG_TIME_UNKNOWN | OMX_BUFFERFLAG_EOS) ?
+				OMX_INVALID_PTS : TicksToPts(buf->nTimeStamp));
+		m_videoBytes += buf->nFilledLen;
+	}
+	m_videoMutex.Unlock();
 	return ret;
 }
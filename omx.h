@@ -31,6 +31,9 @@ extern "C"
 #define OMX_INVALID_PTS -1
 
 class cOmxEvents;
+class cOmxPtsQueue;
+class cOmxBufferPool;
+class cOmxBufferStat;
 
 class cOmx : public cThread
 {
@@ -45,6 +48,7 @@ public:
 	void SetBufferStallCallback(void (*onBufferStall)(void*), void* data);
 	void SetEndOfStreamCallback(void (*onEndOfStream)(void*), void* data);
 	void SetStreamStartCallback(void (*onStreamStart)(void*), void* data);
+	void SetFirstPictureCallback(void (*onFirstPicture)(void*), void* data);
 
 	static OMX_TICKS ToOmxTicks(int64_t val);
 	static int64_t FromOmxTicks(OMX_TICKS &ticks);
@@ -52,6 +56,7 @@ public:
 	static int64_t TicksToPts(OMX_TICKS &ticks);
 
 	int64_t GetSTC(void);
+	int64_t GetCachedSTC(void);
 	bool IsClockRunning(void);
 
 	enum eClockState {
@@ -89,6 +94,7 @@ public:
 
 	void FlushAudio(void);
 	void FlushVideo(bool flushRender = false);
+	void SetVideoDiscontinuity(void);
 
 	int SetVideoCodec(cVideoCodec::eCodec codec);
 	int SetupAudioRender(cAudioCodec::eCodec outputFormat,
@@ -99,6 +105,8 @@ public:
 		return &m_videoFrameFormat;
 	}
 
+	void PresetVideoFrameFormat(const cVideoFrameFormat &format);
+
 	void SetDisplayMode(bool letterbox, bool noaspect);
 	void SetPixelAspectRatio(int width, int height);
 	void SetDisplayRegion(int x, int y, int width, int height);
@@ -112,14 +120,26 @@ public:
 	bool EmptyAudioBuffer(OMX_BUFFERHEADERTYPE *buf);
 	bool EmptyVideoBuffer(OMX_BUFFERHEADERTYPE *buf);
 
+	// average usage of the input buffers in percent
 	void GetBufferUsage(int &audio, int &video);
 
+	// usage in percent, which isn't exceeded by the given percentage of the
+	// recent samples, 0 gives the minimum and 100 the maximum usage
+	void GetBufferUsage(int &audio, int &video, int percentile);
+
+	// buffered duration ahead of the clock in ms, returns false if the clock
+	// isn't running
+	bool GetBufferDuration(int &audio, int &video);
+	void GetInputBufferDuration(int &audio, int &video);
+
 private:
 
 	virtual void Action(void);
 
 	static const char* errStr(int err);
 
+	int VideoBuffers(cVideoCodec::eCodec codec);
+
 #ifdef DEBUG_BUFFERS
 	static void DumpBuffer(OMX_BUFFERHEADERTYPE *buf, const char *prefix = "");
 #endif
@@ -144,28 +164,91 @@ private:
 		eNumTunnels
 	};
 
+	static const char* compStr(eOmxComponent comp) {
+		return  (comp == eClock)          ? "clock"           :
+				(comp == eVideoDecoder)   ? "video decoder"   :
+				(comp == eVideoFx)        ? "video fx"        :
+				(comp == eVideoScheduler) ? "video scheduler" :
+				(comp == eVideoRender)    ? "video render"    :
+				(comp == eAudioRender)    ? "audio render"    : "unknown";
+	}
+
+	enum eTunnelSetupStep {
+		eTunnelSetupIdle,
+		eTunnelSetupConnect,
+		eTunnelSetupStart,
+		eTunnelSetupWaitStarted
+	};
+
+	void StartTunnelSetup(eOmxTunnel tunnel, eOmxComponent sink);
+	bool ContinueTunnelSetup(bool wait);
+	void FinishTunnelSetup(void);
+
 	ILCLIENT_T 	*m_client;
 	COMPONENT_T	*m_comp[cOmx::eNumComponents + 1];
 	TUNNEL_T 	 m_tun[cOmx::eNumTunnels + 1];
 
 	cVideoFrameFormat m_videoFrameFormat;
+	cVideoFrameFormat m_lastVideoFrameFormat;
+	OMX_IMAGEFILTERTYPE m_videoFxFilter;
 
 	bool m_setAudioStartTime;
 	bool m_setVideoStartTime;
 	bool m_setVideoDiscontinuity;
-
-#define BUFFERSTAT_FILTER_SIZE 64
-
-	int m_usedAudioBuffers[BUFFERSTAT_FILTER_SIZE];
-	int m_usedVideoBuffers[BUFFERSTAT_FILTER_SIZE];
+	bool m_videoFrameFormatPreset;
+	bool m_videoRenderStarted;
 
 	OMX_BUFFERHEADERTYPE* m_spareAudioBuffers;
 	OMX_BUFFERHEADERTYPE* m_spareVideoBuffers;
 
+	cOmxPtsQueue *m_audioPts;
+	cOmxPtsQueue *m_videoPts;
+
+	cOmxBufferPool *m_audioBufferPool;
+	cOmxBufferPool *m_videoBufferPool;
+
+	cOmxBufferStat *m_audioBufferStat;
+	cOmxBufferStat *m_videoBufferStat;
+
+	uint64_t m_videoBytes;
+	uint64_t m_videoBytesTime;
+	int m_videoPeakRate;
+
+	eTunnelSetupStep m_tunnelSetupStep;
+	eOmxTunnel m_tunnelSetupTunnel;
+	eOmxComponent m_tunnelSetupComponent;
+	uint64_t m_tunnelSetupTime;
+	uint64_t m_tunnelSetupStepTime;
+	eOmxComponent m_tunnelSetupLateComponent;
+
+	// input buffers, time stamps and flags of each port are protected by the
+	// port's mutex, so audio and video don't wait for each other or for the
+	// reconfiguration of the other port. if needed, Lock() is taken first,
+	// the two port mutexes are never held at the same time
+	cRpiMutex m_audioMutex;
+	cRpiMutex m_videoMutex;
+
+	int m_audioUnderruns;
+	bool m_audioRunDry;
+	int m_videoReconfigUnderruns;
+	uint64_t m_videoReconfigTime;
+
 	eClockReference	m_clockReference;
 	OMX_S32 m_clockScale;
 
+	// the cached STC has its own mutex, so it can be read while Lock() is
+	// held for a reconfiguration
+	cRpiMutex m_stcMutex;
+	int64_t  m_stcCache;
+	uint64_t m_stcCacheTime;
+	bool     m_stcCacheAdvancing;
+	uint64_t m_stcCalls;
+	uint64_t m_stcReads;
+	uint64_t m_stcReadUs;
+	uint64_t m_stcStatTime;
+
 	cOmxEvents *m_portEvents;
+	int m_lostBuffersEmptied[eNumComponents];
 	bool m_handlePortEvents;
 
 	void (*m_onBufferStall)(void*);
@@ -177,8 +260,14 @@ private:
 	void (*m_onStreamStart)(void*);
 	void *m_onStreamStartData;
 
+	void (*m_onFirstPicture)(void*);
+	void *m_onFirstPictureData;
+
 	void HandlePortBufferEmptied(eOmxComponent component);
 	void HandlePortSettingsChanged(unsigned int portId);
+	void HandleVideoFrameFormatPreset(void);
+	void SetVideoFxFilter(void);
+	void InvalidateCachedSTC(void);
 	void SetPARChangeCallback(bool enable);
 	void SetBufferStallThreshold(int delayMs);
 	bool IsBufferStall(void);
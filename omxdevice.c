@@ -21,6 +21,7 @@
 #include "omx.h"
 #include "audio.h"
 #include "display.h"
+#include "jpeg.h"
 #include "setup.h"
 #include "tools.h"
 
@@ -28,68 +29,336 @@
 #include <vdr/remux.h>
 #include <vdr/tools.h>
 #include <vdr/skins.h>
+#include <vdr/plugin.h>
+#include <vdr/channels.h>
 
 #include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
 
 #define S(x) ((int)(floor(x * pow(2, 16))))
 #define PTS_START_OFFSET (32 * (MAX33BIT + 1))
 
-#define PRE_ROLL_LIVE 250
 #define PRE_ROLL_PLAYBACK 0
 
+// time stamp jumps bigger than this are considered as discontinuity, e.g.
+// caused by splices or PCR resets, and rebased during normal playback
+#define PTS_DISCONTINUITY_THRESHOLD 90000	// 1s
+
+// during normal playback the STC trails the latest time stamps by no more
+// than the buffered duration
+#define STC_MAX_LAG 900000					// 10s
+
+// pictures before a seek target are decoded but not shown, targets further
+// away than this from the first picture are ignored
+#define SEEK_MAX_DISTANCE 900000			// 10s
+#define SEEK_REORDER_DISTANCE 45000			// 500ms
+
+// video is released if no video has been received for this period while audio
+// is played, e.g. after switching to a radio service within the same player
+#define VIDEO_RELEASE_TIMEOUT 3000			// ms
+
+// when starting live TV on audio, video waits at most this period for audio
+// before the clock is started on video
+#define AUDIO_FIRST_TIMEOUT 1000			// ms
+
+// pre-roll for live TV is learned per channel from the minimum buffered
+// duration seen while watching, increased on underruns and stored in the
+// plugin's configuration directory
+#define LIVE_PREROLL_MIN 50					// ms
+#define LIVE_PREROLL_MAX 2000				// ms
+#define LIVE_PREROLL_MARGIN 50				// ms
+#define LIVE_PREROLL_UNDERRUN 20			// ms
+#define LIVE_PREROLL_MIN_SAMPLES 20
+#define LIVE_PREROLL_FILE "preroll.conf"
+
+// a buffer stall within this period after the last recovery is considered as
+// persisting and escalated to the next recovery level. it covers the restart
+// of the stream only, a later stall starts over with the cheapest recovery
+#define BUFFER_STALL_ESCALATION 5000		// ms
+
+// speed correction for live mode is limited, since HDMI specification allows
+// a tolerance of 1000ppm, however on the Raspberry Pi it's limited to 175ppm
+// to avoid audio drops one some A/V receivers
+#define LIVE_SPEED_MAX_CORRECTION 150	// ppm
+#define LIVE_SPEED_INTERVAL 500			// ms
+
+// PI controller gains as divisors of the buffered duration error in ms, giving
+// the correction in ppm. the integral is accumulated in ms and scaled once
+#define LIVE_SPEED_P_DIVISOR 2
+#define LIVE_SPEED_I_DIVISOR 20
+
 // trick speeds as defined in vdr/dvbplayer.c
 const int cOmxDevice::s_playbackSpeeds[eNumDirections][eNumPlaybackSpeeds] = {
 	{ S(0.0f), S( 0.125f), S( 0.25f), S( 0.5f), S( 1.0f), S( 2.0f), S( 4.0f), S( 12.0f) },
 	{ S(0.0f), S(-0.125f), S(-0.25f), S(-0.5f), S(-1.0f), S(-2.0f), S(-4.0f), S(-12.0f) }
 };
 
-// speed correction factors for live mode
-// HDMI specification allows a tolerance of 1000ppm, however on the Raspberry Pi
-// it's limited to 175ppm to avoid audio drops one some A/V receivers
-const int cOmxDevice::s_liveSpeeds[eNumLiveSpeeds] = {
-	S(0.999f), S(0.99985f), S(1.000f), S(1.00015), S(1.001)
-};
+const uchar cOmxDevice::s_mpeg2EndOfSequence[4]  = { 0x00, 0x00, 0x01, 0xb7 };
+const uchar cOmxDevice::s_h264EndOfSequence[8] = { 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x01, 0x0b };
+
+#ifdef ENABLE_DIRECT_TS
+// TS packet with payload unit start indicator, but adaptation field only
+const uchar cOmxDevice::s_tsPayloadStart[TS_SIZE] = { 0x47, 0x40, 0x00, 0x20, 0xb7 };
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+// learned pre-roll per channel ID, loaded on first use. the table is changed
+// whenever a live session on a channel ends with a changed value, and saved by
+// the caller after the device lock has been released. apart from Save(), all
+// members must be called with the device lock held, there is no lock of its own
+
+class cOmxDevice::cLivePreRoll
+{
+
+public:
+
+	cLivePreRoll() :
+		m_loaded(false),
+		m_modified(false),
+		m_preRoll(0),
+		m_minBuffered(0),
+		m_samples(0),
+		m_underruns(0)
+	{ }
+
+	void Start(int channelNumber, int defaultPreRoll)
+	{
+		Stop();
+		Load();
+
+		m_channel = ChannelId(channelNumber);
+		std::map<std::string, int>::iterator it = m_preRolls.find(m_channel);
+		m_preRoll = it != m_preRolls.end() ? it->second : defaultPreRoll;
+		m_minBuffered = LIVE_PREROLL_MAX;
+		m_samples = 0;
+		m_underruns = 0;
+
+		DBG("using pre-roll of %dms for %s", m_preRoll,
+				m_channel.empty() ? "unknown channel" : m_channel.c_str());
+	}
+
+	void Stop(void)
+	{
+		if (!m_channel.empty() && m_samples >= LIVE_PREROLL_MIN_SAMPLES)
+		{
+			int preRoll = m_preRoll;
+
+			// back off quickly on underruns, otherwise follow the observed
+			// jitter slowly with some margin
+			if (m_underruns)
+				preRoll = preRoll * 3 / 2;
+			else
+				preRoll = (preRoll * 3 + (m_preRoll - m_minBuffered) * 3 / 2 +
+						LIVE_PREROLL_MARGIN) / 4;
+
+			preRoll = constrain(preRoll, LIVE_PREROLL_MIN, LIVE_PREROLL_MAX);
+
+			DBG("pre-roll for %s: %dms -> %dms (%d underruns, min %dms)",
+					m_channel.c_str(), m_preRoll, preRoll, m_underruns,
+					m_minBuffered);
+
+			if (preRoll != m_preRoll)
+			{
+				m_preRolls[m_channel] = preRoll;
+				m_modified = true;
+			}
+		}
+		m_channel.clear();
+		m_preRoll = 0;
+	}
+
+	void Update(int bufferedMs)
+	{
+		m_samples++;
+		m_minBuffered = std::min(m_minBuffered, bufferedMs);
+		if (bufferedMs < LIVE_PREROLL_UNDERRUN)
+			m_underruns++;
+	}
+
+	void Underrun(void)
+	{
+		m_underruns++;
+	}
+
+	// returns 0 if no live session has been started
+	int PreRoll(void) const
+	{
+		return m_preRoll;
+	}
+
+	// copies the table if it has been changed since the last call
+	bool GetModified(std::map<std::string, int> &preRolls)
+	{
+		if (!m_modified)
+			return false;
+
+		preRolls = m_preRolls;
+		m_modified = false;
+		return true;
+	}
+
+	static void Save(const std::map<std::string, int> &preRolls)
+	{
+		cSafeFile f(AddDirectory(
+				cPlugin::ConfigDirectory("rpihddevice"), LIVE_PREROLL_FILE));
+
+		if (f.Open())
+		{
+			for (std::map<std::string, int>::const_iterator it =
+					preRolls.begin(); it != preRolls.end(); ++it)
+				fprintf(f, "%s %d\n", it->first.c_str(), it->second);
+			f.Close();
+		}
+		else
+			ELOG("failed to save live pre-roll!");
+	}
+
+private:
+
+	cLivePreRoll(const cLivePreRoll&);
+	cLivePreRoll& operator= (const cLivePreRoll&);
+
+	static std::string ChannelId(int channelNumber)
+	{
+		std::string id;
+
+		// don't wait for the channels lock, since the main thread may hold
+		// it while waiting for the transfer to stop
+#if APIVERSNUM >= 20301
+		cStateKey key;
+		if (const cChannels *channels = cChannels::GetChannelsRead(key, 10))
+		{
+			if (const cChannel *channel = channels->GetByNumber(channelNumber))
+				id = *channel->GetChannelID().ToString();
+			key.Remove();
+		}
+#else
+		if (cChannel *channel = Channels.GetByNumber(channelNumber))
+			id = *channel->GetChannelID().ToString();
+#endif
+		return id;
+	}
+
+	void Load(void)
+	{
+		if (m_loaded)
+			return;
+
+		m_loaded = true;
+		cString fileName = AddDirectory(
+				cPlugin::ConfigDirectory("rpihddevice"), LIVE_PREROLL_FILE);
+
+		if (FILE *f = fopen(fileName, "r"))
+		{
+			cReadLine readLine;
+			while (char *line = readLine.Read(f))
+			{
+				char id[256];
+				int preRoll;
+				if (sscanf(line, "%255s %d", id, &preRoll) == 2)
+					m_preRolls[id] = constrain(preRoll,
+							LIVE_PREROLL_MIN, LIVE_PREROLL_MAX);
+			}
+			fclose(f);
+		}
+	}
 
-const uchar cOmxDevice::s_pesVideoHeader[14] = {
-	0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05, 0x00, 0x00, 0x00, 0x00, 0x00
+	std::map<std::string, int> m_preRolls;
+	bool m_loaded;
+	bool m_modified;
+
+	std::string m_channel;
+	int m_preRoll;
+	int m_minBuffered;
+	int m_samples;
+	int m_underruns;
 };
 
-const uchar cOmxDevice::s_mpeg2EndOfSequence[4]  = { 0x00, 0x00, 0x01, 0xb7 };
-const uchar cOmxDevice::s_h264EndOfSequence[8] = { 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x01, 0x0b };
+/* ------------------------------------------------------------------------- */
 
 cOmxDevice::cOmxDevice(void (*onPrimaryDevice)(void), int display, int layer) :
 	cDevice(),
 	m_onPrimaryDevice(onPrimaryDevice),
 	m_omx(new cOmx()),
 	m_audio(new cRpiAudioDecoder(m_omx)),
-	m_mutex(new cMutex()),
+	m_livePreRoll(new cLivePreRoll()),
+	m_mutex(new cRpiMutex("device")),
+	m_videoMutex(new cRpiMutex("video input")),
+	m_videoGeneration(0),
 	m_timer(new cTimeMs()),
 	m_videoCodec(cVideoCodec::eInvalid),
 	m_playMode(pmNone),
-	m_liveSpeed(eNoCorrection),
 	m_playbackSpeed(eNormal),
 	m_direction(eForward),
 	m_hasVideo(false),
 	m_hasAudio(false),
+	m_presetVideoFormat(false),
 	m_skipAudio(false),
+	m_skipVideo(false),
 	m_playDirection(0),
 	m_trickRequest(0),
 	m_audioPts(0),
 	m_videoPts(0),
+	m_ptsOffset(0),
+	m_prevPtsOffset(0),
+	m_ptsOffsetStart(0),
+	m_audioPtsOffset(0),
+	m_videoPtsOffset(0),
+	m_audioPtsStep(0),
+	m_videoPtsStep(0),
 	m_lastStc(0),
+	m_waitForAudio(0),
+	m_releaseFirstPicture(0),
+	m_zapStart(0),
+	m_seekTarget(OMX_INVALID_PTS),
+	m_seekTargetStc(OMX_INVALID_PTS),
+	m_seekStart(0),
+	m_seekLastPts(OMX_INVALID_PTS),
+	m_decodeOnly(false),
+	m_decodeOnlyPictures(0),
+	m_stallRecovery(eRestartClock),
+	m_lastStall(0),
+	m_stillPictureStart(0),
+	m_lastVideo(0),
+	m_pendingVideoBuffer(0),
+	m_directTs(false),
+	m_copiedBytes(0),
+	m_copyStatTime(0),
+	m_liveSpeedCorrection(0),
+	m_liveSpeedIntegral(0),
+	m_grabBuffer(0),
+	m_grabBufferSize(0),
+	m_grabMutex(new cMutex()),
 	m_display(display),
 	m_layer(layer)
 {
+	for (int i = 0; i < eNumStallRecoveries; i++)
+	{
+		m_stallRecoveries[i] = 0;
+		m_stallRecoveryTime[i] = 0;
+	}
 }
 
 cOmxDevice::~cOmxDevice()
 {
 	DeInit();
 
+	std::map<std::string, int> preRolls;
+	m_livePreRoll->Stop();
+	if (m_livePreRoll->GetModified(preRolls))
+		cLivePreRoll::Save(preRolls);
+
+	delete m_livePreRoll;
 	delete m_omx;
 	delete m_audio;
 	delete m_mutex;
+	delete m_videoMutex;
 	delete m_timer;
+	delete m_grabMutex;
+	free(m_grabBuffer);
 }
 
 int cOmxDevice::Init(void)
@@ -107,6 +376,7 @@ int cOmxDevice::Init(void)
 	m_omx->SetBufferStallCallback(&OnBufferStall, this);
 	m_omx->SetEndOfStreamCallback(&OnEndOfStream, this);
 	m_omx->SetStreamStartCallback(&OnStreamStart, this);
+	m_omx->SetFirstPictureCallback(&OnFirstPicture, this);
 
 	cRpiSetup::SetVideoSetupChangedCallback(&OnVideoSetupChanged, this);
 
@@ -161,6 +431,9 @@ void cOmxDevice::ScaleVideo(const cRect &Rect)
 
 bool cOmxDevice::SetPlayMode(ePlayMode PlayMode)
 {
+	std::map<std::string, int> preRolls;
+	bool savePreRolls = false;
+
 	m_mutex->Lock();
 	DBG("SetPlayMode(%s)",
 		PlayMode == pmNone			 ? "none" 			   :
@@ -179,12 +452,15 @@ bool cOmxDevice::SetPlayMode(ePlayMode PlayMode)
 	switch (PlayMode)
 	{
 	case pmNone:
+		m_livePreRoll->Stop();
+		savePreRolls = m_livePreRoll->GetModified(preRolls);
 		FlushStreams(true);
 		m_omx->StopVideo();
 		m_hasAudio = false;
 		m_hasVideo = false;
 		m_videoCodec = cVideoCodec::eInvalid;
 		m_playMode = pmNone;
+		ResetSeekTarget();
 		break;
 
 	case pmAudioVideo:
@@ -193,6 +469,7 @@ bool cOmxDevice::SetPlayMode(ePlayMode PlayMode)
 	case pmVideoOnly:
 		m_playbackSpeed = eNormal;
 		m_direction = eForward;
+		m_zapStart = Transferring() ? cTimeMs::Now() : 0;
 		break;
 
 	default:
@@ -200,6 +477,11 @@ bool cOmxDevice::SetPlayMode(ePlayMode PlayMode)
 	}
 
 	m_mutex->Unlock();
+
+	// the file is written without holding the device lock
+	if (savePreRolls)
+		cLivePreRoll::Save(preRolls);
+
 	return true;
 }
 
@@ -210,25 +492,17 @@ void cOmxDevice::StillPicture(const uchar *Data, int Length)
 	else
 	{
 		DBG("StillPicture()");
-		int pesLength = 0;
-		uchar *pesPacket = 0;
 
+		// some plugins deliver raw MPEG data instead of PES packets, which
+		// is passed to the decoder directly with a time stamp of zero
+		bool raw = true;
 		cVideoCodec::eCodec codec = ParseVideoCodec(Data, Length);
-		if (codec != cVideoCodec::eInvalid)
+		if (codec == cVideoCodec::eInvalid)
 		{
-			// some plugins deliver raw MPEG data, but PlayVideo() needs a
-			// complete PES packet with valid header
-			pesLength = Length + sizeof(s_pesVideoHeader);
-			pesPacket = MALLOC(uchar, pesLength);
-			if (!pesPacket)
-				return;
-
-			memcpy(pesPacket, s_pesVideoHeader, sizeof(s_pesVideoHeader));
-			memcpy(pesPacket + sizeof(s_pesVideoHeader), Data, Length);
-		}
-		else
+			raw = false;
 			codec = ParseVideoCodec(Data + PesPayloadOffset(Data),
 					Length - PesPayloadOffset(Data));
+		}
 
 		if (codec == cVideoCodec::eInvalid)
 			return;
@@ -238,30 +512,49 @@ void cOmxDevice::StillPicture(const uchar *Data, int Length)
 		m_direction = eForward;
 		m_hasVideo = false;
 		m_omx->StopClock();
+		m_stillPictureStart = cTimeMs::Now();
+		ResetSeekTarget();
 
-		// since the stream might be interlaced, we send each frame twice, so
-		// the advanced deinterlacer is able to render an output picture
+		// the advanced deinterlacer needs a second field pair to render an
+		// output picture, so send the frame twice unless the sequence header
+		// tells that it's not going to be used
 		int repeat = 2;
+		cVideoFrameFormat format;
+		bool scanModeKnown;
+		if (ParseVideoFrameFormat(codec,
+				raw ? Data : Data + PesPayloadOffset(Data),
+				raw ? Length : Length - PesPayloadOffset(Data), format,
+				scanModeKnown) && scanModeKnown &&
+				!(format.Interlaced() && cRpiDisplay::IsProgressive() &&
+				cRpiSetup::UseAdvancedDeinterlacer(format.width, format.height)))
+			repeat = 1;
+
 		while (repeat--)
 		{
-			int length = pesPacket ? pesLength : Length;
-			const uchar *data = pesPacket ? pesPacket : Data;
-
-			// play every single PES packet, rise ENDOFFRAME flag on last
-			while (PesLongEnough(length))
+			if (raw)
+				PlayVideoPayload(Data, Length, 0, true);
+			else
 			{
-				int pktLen = PesHasLength(data) ? PesLength(data) : length;
+				int length = Length;
+				const uchar *data = Data;
+
+				// play every single PES packet, rise ENDOFFRAME flag on last
+				while (PesLongEnough(length))
+				{
+					int pktLen = PesHasLength(data) ? PesLength(data) : length;
 
-				// skip non-video packets as they may occur in PES recordings
-				if ((data[3] & 0xf0) == 0xe0)
-					PlayVideo(data, pktLen, pktLen == length);
+					// skip non-video packets as they may occur in PES recordings
+					if ((data[3] & 0xf0) == 0xe0)
+						PlayVideoPayload(data + PesPayloadOffset(data),
+								pktLen - PesPayloadOffset(data),
+								PesHasPts(data) ? PesGetPts(data) : OMX_INVALID_PTS,
+								pktLen == length);
 
-				data += pktLen;
-				length -= pktLen;
+					data += pktLen;
+					length -= pktLen;
+				}
 			}
 		}
-		if (pesPacket)
-			free(pesPacket);
 
 		SubmitEOS();
 		m_mutex->Unlock();
@@ -291,25 +584,53 @@ int cOmxDevice::PlayAudio(const uchar *Data, int Length, uchar Id)
 			if (!m_hasVideo)
 			{
 				DBG("audio first");
+				if (Transferring())
+					m_livePreRoll->Start(CurrentChannel(),
+							cRpiSetup::GetLiveLatency());
+
 				m_omx->SetClockScale(
 						s_playbackSpeeds[m_direction][m_playbackSpeed]);
 				m_omx->StartClock(m_hasVideo, m_hasAudio,
-						Transferring() ? PRE_ROLL_LIVE : PRE_ROLL_PLAYBACK);
+						std::max(0, PreRoll() - SeekDistance(pts)));
 				m_audioPts = PTS_START_OFFSET + pts;
+				m_audioPtsOffset = 0;
+				m_ptsOffset = 0;
+				m_prevPtsOffset = 0;
+				m_ptsOffsetStart = 0;
 				m_playMode = pmAudioOnly;
 			}
 			else
 			{
-				m_audioPts = m_videoPts + PtsDiff(m_videoPts & MAX33BIT, pts);
+				m_audioPts = m_videoPts + PtsDiff(
+						(m_videoPts - m_videoPtsOffset) & MAX33BIT, pts);
+				m_audioPtsOffset = m_videoPtsOffset;
 				m_playMode = pmAudioVideo;
+
+				if (m_waitForAudio)
+				{
+					DBG("audio first start after %llums",
+							cTimeMs::Now() - m_waitForAudio);
+					m_waitForAudio = 0;
+					m_omx->StartClock(false, m_hasAudio, PreRoll());
+				}
 			}
+			m_audioPtsStep = 0;
 		}
 
-		int64_t ptsDiff = PtsDiff(m_audioPts & MAX33BIT, pts);
+		int64_t ptsDiff = PtsDiff(
+				(m_audioPts - m_audioPtsOffset) & MAX33BIT, pts);
 
-		if ((m_audioPts & ~MAX33BIT) != (m_audioPts + ptsDiff & ~MAX33BIT))
+		if (((m_audioPts - m_audioPtsOffset) & ~MAX33BIT) !=
+				((m_audioPts - m_audioPtsOffset + ptsDiff) & ~MAX33BIT))
 			DBG("audio PTS wrap around");
 
+		if (llabs(ptsDiff) > PTS_DISCONTINUITY_THRESHOLD && !m_trickRequest &&
+				m_playbackSpeed == eNormal && m_direction == eForward)
+			RebasePts(m_audioPts, m_audioPtsOffset, m_audioPtsStep, pts, ptsDiff,
+					m_hasVideo, m_videoPts, m_videoPtsOffset);
+		else if (ptsDiff > 0)
+			m_audioPtsStep = ptsDiff;
+
 		m_audioPts += ptsDiff;
 
 		// keep track of direction in case of trick speed
@@ -336,31 +657,86 @@ int cOmxDevice::PlayAudio(const uchar *Data, int Length, uchar Id)
 				pts != OMX_INVALID_PTS ? m_audioPts : OMX_INVALID_PTS))
 			ret = 0;
 	}
+	// release video pipeline if audio continues without video
+	if (ret && m_hasVideo && m_hasAudio && !m_trickRequest &&
+			m_playbackSpeed == eNormal && m_direction == eForward &&
+			cTimeMs::Now() - m_lastVideo > VIDEO_RELEASE_TIMEOUT)
+		ReleaseVideo();
+
+	if (ret && Transferring())
+		AdjustLiveSpeed();
+
 	m_mutex->Unlock();
 
 	if (Transferring() && !ret)
 		DBG("failed to write %d bytes of audio packet!", Length);
 
-	if (ret && Transferring())
-		AdjustLiveSpeed();
-
 	return ret;
 }
 
 int cOmxDevice::PlayVideo(const uchar *Data, int Length, bool EndOfFrame)
 {
+	m_lastVideo = cTimeMs::Now();
+
 	// prevent writing incomplete frames
-	if (m_hasVideo && !m_omx->PollVideo())
+	if (m_hasVideo && !PollVideo())
 		return 0;
 
+	// the device lock only serializes the state changes, parsing and copying
+	// of the payload is done outside
+	const uchar *payload = Data + PesPayloadOffset(Data);
+	int length = Length - PesPayloadOffset(Data);
+	int64_t pts = PesHasPts(Data) ? PesGetPts(Data) : OMX_INVALID_PTS;
+	cVideoCodec::eCodec codec = ParseVideoCodec(payload, length);
+
 	m_mutex->Lock();
+	bool decodeOnly = PrepareVideo(codec, payload, length, pts);
+	int generation = m_videoGeneration;
+	m_mutex->Unlock();
+
 	int ret = Length;
+	if (length > 0 && !WriteVideo(payload, length, pts, EndOfFrame, false,
+			decodeOnly, generation))
+		ret = 0;
+
+	if (Transferring() && !ret)
+		DBG("failed to write %d bytes of video packet!", Length);
+
+	if (ret && Transferring())
+	{
+		m_mutex->Lock();
+		AdjustLiveSpeed();
+		m_mutex->Unlock();
+	}
+
+	return ret;
+}
 
-	cVideoCodec::eCodec codec = ParseVideoCodec(Data + PesPayloadOffset(Data),
-			Length - PesPayloadOffset(Data));
+// pass elementary stream data to the decoder, must be called with m_mutex
+// locked, returns false if the decoder is busy and the data should be retried
 
-	int64_t pts = PesHasPts(Data) && codec != cVideoCodec::eInvalid ?
-			PesGetPts(Data) : OMX_INVALID_PTS;
+bool cOmxDevice::PlayVideoPayload(const uchar *Data, int Length, int64_t pts,
+		bool EndOfFrame, bool KeepPending)
+{
+	bool decodeOnly = PrepareVideo(ParseVideoCodec(Data, Length),
+			Data, Length, pts);
+
+	return Length <= 0 || WriteVideo(Data, Length, pts, EndOfFrame,
+			KeepPending, decodeOnly);
+}
+
+// handle state changes caused by elementary stream data, must be called with
+// m_mutex locked. returns the length and time stamp of the data which is left
+// to be written to the decoder, and whether it is to be decoded only
+
+bool cOmxDevice::PrepareVideo(cVideoCodec::eCodec codec, const uchar *Data,
+		int &Length, int64_t &pts)
+{
+	// MPEG2 P and B pictures aren't detected by ParseVideoCodec(), but their
+	// PES time stamp is still valid to match a seek target
+	int64_t pesPts = pts;
+	if (codec == cVideoCodec::eInvalid)
+		pts = OMX_INVALID_PTS;
 
 	if (!m_hasVideo && pts != OMX_INVALID_PTS &&
 			m_videoCodec == cVideoCodec::eInvalid)
@@ -370,7 +746,12 @@ int cOmxDevice::PlayVideo(const uchar *Data, int Length, bool EndOfFrame)
 			m_videoCodec = codec;
 			if (cRpiSetup::IsVideoCodecSupported(m_videoCodec))
 			{
+				if (m_hasAudio)
+					DLOG("video is back, free GPU memory %dM",
+							cRpiSetup::GetFreeGpuMemory());
+
 				m_omx->SetVideoCodec(m_videoCodec);
+				m_presetVideoFormat = true;
 				DLOG("set video codec to %s", cVideoCodec::Str(m_videoCodec));
 			}
 			else
@@ -378,6 +759,27 @@ int cOmxDevice::PlayVideo(const uchar *Data, int Length, bool EndOfFrame)
 		}
 	}
 
+	// parse stream headers to set up display mode and deinterlacer while
+	// the decoder is still busy with the first frames. if the scan mode isn't
+	// known, only the resolution is preset and the port settings tell later
+	if (m_presetVideoFormat && codec != cVideoCodec::eInvalid)
+	{
+		cVideoFrameFormat format;
+		bool scanModeKnown;
+		if (ParseVideoFrameFormat(codec, Data, Length, format, scanModeKnown))
+		{
+			DBG("preset video format %dx%d@%d%s, PAR=%d/%d",
+					format.width, format.height, format.frameRate,
+					!scanModeKnown ? "?" : format.Interlaced() ? "i" : "p",
+					format.pixelWidth, format.pixelHeight);
+
+			m_omx->PresetVideoFrameFormat(format);
+			m_presetVideoFormat = false;
+		}
+		else if (m_omx->GetVideoFrameFormat()->width)
+			m_presetVideoFormat = false;
+	}
+
 	if (!m_hasVideo && pts != OMX_INVALID_PTS &&
 			cRpiSetup::IsVideoCodecSupported(m_videoCodec))
 	{
@@ -385,25 +787,65 @@ int cOmxDevice::PlayVideo(const uchar *Data, int Length, bool EndOfFrame)
 		if (!m_hasAudio)
 		{
 			DBG("video first");
+			if (Transferring())
+				m_livePreRoll->Start(CurrentChannel(),
+						cRpiSetup::GetLiveLatency());
+
 			m_omx->SetClockReference(cOmx::eClockRefVideo);
 			m_omx->SetClockScale(s_playbackSpeeds[m_direction][m_playbackSpeed]);
-			m_omx->StartClock(m_hasVideo, m_hasAudio,
-					Transferring() ? PRE_ROLL_LIVE : PRE_ROLL_PLAYBACK);
+
+			// let audio start the clock, video joins when its first
+			// picture is due
+			if (Transferring() && cRpiSetup::IsAudioFirstStart())
+				m_waitForAudio = cTimeMs::Now();
+
+			// for live TV, start paused without pre-roll, so the first
+			// picture is shown immediately and held until the pre-roll
+			// has been buffered
+			else if (Transferring() && PreRoll())
+			{
+				m_releaseFirstPicture = cTimeMs::Now() + PreRoll();
+				m_omx->SetClockScale(0);
+				m_omx->StartClock(m_hasVideo, m_hasAudio, 0);
+			}
+			else
+				m_omx->StartClock(m_hasVideo, m_hasAudio,
+						std::max(0, PreRoll() - SeekDistance(pts)));
+
 			m_videoPts = PTS_START_OFFSET + pts;
+			m_videoPtsOffset = 0;
+			m_ptsOffset = 0;
+			m_prevPtsOffset = 0;
+			m_ptsOffsetStart = 0;
 			m_playMode = pmVideoOnly;
 		}
 		else
 		{
-			m_videoPts = m_audioPts + PtsDiff(m_audioPts & MAX33BIT, pts);
+			m_videoPts = m_audioPts + PtsDiff(
+					(m_audioPts - m_audioPtsOffset) & MAX33BIT, pts);
+			m_videoPtsOffset = m_audioPtsOffset;
 			m_playMode = pmAudioVideo;
 		}
+		m_videoPtsStep = 0;
 	}
 
+	CheckAudioFirstTimeout();
+
 	if (m_hasVideo)
 	{
 		if (pts != OMX_INVALID_PTS)
 		{
-			int64_t ptsDiff = PtsDiff(m_videoPts & MAX33BIT, pts);
+			int64_t ptsDiff = PtsDiff(
+					(m_videoPts - m_videoPtsOffset) & MAX33BIT, pts);
+
+			if (llabs(ptsDiff) > PTS_DISCONTINUITY_THRESHOLD &&
+					!m_trickRequest && m_playbackSpeed == eNormal &&
+					m_direction == eForward)
+				RebasePts(m_videoPts, m_videoPtsOffset, m_videoPtsStep, pts,
+						ptsDiff, m_hasAudio, m_audioPts, m_audioPtsOffset);
+			else if (ptsDiff > 0)
+				m_videoPtsStep = ptsDiff;
+
 			m_videoPts += ptsDiff;
 
 			// keep track of direction in case of trick speed
@@ -411,50 +853,216 @@ int cOmxDevice::PlayVideo(const uchar *Data, int Length, bool EndOfFrame)
 				PtsTracker(ptsDiff);
 		}
 
-		// skip PES header, proceed with payload towards OMX
-		Length -= PesPayloadOffset(Data);
-		Data += PesPayloadOffset(Data);
+		if (m_seekTarget != OMX_INVALID_PTS)
+			UpdateSeekTarget(pesPts);
 
-		while (Length > 0)
+		// feed intra coded pictures only for fast trick speeds, so the
+		// decoder doesn't waste time on pictures the scheduler would drop
+		if (m_playbackSpeed > eNormal)
 		{
-			if (OMX_BUFFERHEADERTYPE *buf =	m_omx->GetVideoBuffer(
-					pts != OMX_INVALID_PTS ? m_videoPts : OMX_INVALID_PTS))
+			ePictureType type = ParsePictureType(m_videoCodec, Data, Length);
+			if (type != ePictureUnknown)
 			{
-				buf->nFilledLen = buf->nAllocLen < (unsigned)Length ?
-						buf->nAllocLen : Length;
+				if (m_skipVideo && type == ePictureI)
+					m_omx->SetVideoDiscontinuity();
 
-				memcpy(buf->pBuffer, Data, buf->nFilledLen);
-				Length -= buf->nFilledLen;
-				Data += buf->nFilledLen;
+				if (m_skipVideo != (type != ePictureI))
+					DBG("%s picture, %s video", PictureTypeStr(type),
+							type != ePictureI ? "skipping" : "resuming");
 
-				if (EndOfFrame && !Length)
-					buf->nFlags |= OMX_BUFFERFLAG_ENDOFFRAME;
+				m_skipVideo = type != ePictureI;
+			}
+			if (m_skipVideo)
+				Length = 0;
+		}
+		else
+			m_skipVideo = false;
 
-				if (!m_omx->EmptyVideoBuffer(buf))
-				{
-					ret = 0;
-					ELOG("failed to pass buffer to video decoder!");
-					break;
-				}
+		if (pts != OMX_INVALID_PTS)
+			pts = m_videoPts;
+	}
+	else
+		Length = 0;
+
+	return m_decodeOnly;
+}
+
+// copy elementary stream data into the decoder's input buffers. if requested,
+// the last buffer is kept to be filled up by the following TS packets until a
+// new PES packet starts. data prepared before the streams have been flushed
+// is dropped, if the generation it has been prepared for is given. whether
+// the data is decoded only is taken from PrepareVideo() along with the
+// generation, since the seek state may change in between
+bool cOmxDevice::WriteVideo(const uchar *Data, int Length, int64_t pts,
+		bool EndOfFrame, bool KeepPending, bool DecodeOnly, int generation)
+{
+	bool ret = true;
+	m_videoMutex->Lock();
+
+	if (generation >= 0 && generation != m_videoGeneration)
+		Length = 0;
+
+	while (Length > 0)
+	{
+		OMX_BUFFERHEADERTYPE *buf = m_pendingVideoBuffer;
+		m_pendingVideoBuffer = 0;
+
+		// TS packets of the direct path aren't split across buffers, so a
+		// packet is either written completely or can be retried
+		if (buf && (pts != OMX_INVALID_PTS || buf->nAllocLen - buf->nFilledLen <
+				(KeepPending ? (unsigned int)Length : 1)))
+		{
+			if (!m_omx->EmptyVideoBuffer(buf))
+				ELOG("failed to pass buffer to video decoder!");
+			buf = 0;
+		}
+		if (!buf)
+		{
+			buf = m_omx->GetVideoBuffer(pts);
+			if (!buf)
+			{
+				ret = false;
+				break;
 			}
-			else
+
+			if (DecodeOnly)
+				buf->nFlags |= OMX_BUFFERFLAG_DECODEONLY;
+		}
+
+		unsigned int length = std::min((unsigned int)Length,
+				buf->nAllocLen - buf->nFilledLen);
+
+		memcpy(buf->pBuffer + buf->nFilledLen, Data, length);
+		buf->nFilledLen += length;
+		m_copiedBytes += length;
+		Length -= length;
+		Data += length;
+		pts = OMX_INVALID_PTS;
+
+		if (KeepPending && !Length)
+			m_pendingVideoBuffer = buf;
+		else
+		{
+			if (EndOfFrame && !Length)
+				buf->nFlags |= OMX_BUFFERFLAG_ENDOFFRAME;
+
+			if (!m_omx->EmptyVideoBuffer(buf))
 			{
-				ret = 0;
+				ELOG("failed to pass buffer to video decoder!");
+				ret = false;
 				break;
 			}
-			pts = OMX_INVALID_PTS;
 		}
 	}
+	m_videoMutex->Unlock();
+	return ret;
+}
+
+// pass the pending buffer of the direct TS path to the decoder
+void cOmxDevice::SubmitPendingVideo(bool EndOfFrame)
+{
+	m_videoMutex->Lock();
+	if (OMX_BUFFERHEADERTYPE *buf = m_pendingVideoBuffer)
+	{
+		m_pendingVideoBuffer = 0;
+		if (EndOfFrame)
+			buf->nFlags |= OMX_BUFFERFLAG_ENDOFFRAME;
+
+		if (!m_omx->EmptyVideoBuffer(buf))
+			ELOG("failed to pass buffer to video decoder!");
+	}
+	m_videoMutex->Unlock();
+}
+
+#ifdef ENABLE_DIRECT_TS
+// during normal playback, the payload of video TS packets is written to the
+// decoder's input buffers directly, saving the copy of VDR's PES assembly.
+// the path is chosen at the start of each PES packet, trick speeds and PES
+// headers spanning several TS packets fall back to cDevice::PlayTsVideo()
+int cOmxDevice::PlayTsVideo(const uchar *Data, int Length)
+{
+	m_lastVideo = cTimeMs::Now();
+	if (!TsHasPayload(Data))
+		return Length;
+
+	const uchar *payload = Data + TsPayloadOffset(Data);
+	int length = Length - TsPayloadOffset(Data);
+	if (length <= 0)
+		return Length;
+
+	if (TsPayloadStart(Data))
+	{
+		if (m_hasVideo && !PollVideo())
+			return 0;
+
+		m_mutex->Lock();
+		SubmitPendingVideo(true);
+
+		bool directTs = !m_trickRequest && m_playbackSpeed == eNormal &&
+				m_direction == eForward && PesLongEnough(length) &&
+				PesPayloadOffset(payload) <= length;
+
+		// the last PES packet of the fallback is still in VDR's assembler,
+		// which passes it on only when it sees the next payload start
+		if (directTs && !m_directTs &&
+				cDevice::PlayTsVideo(s_tsPayloadStart, TS_SIZE) <= 0)
+		{
+			m_mutex->Unlock();
+			return 0;
+		}
+		m_directTs = directTs;
+
+		int ret = Length;
+		if (m_directTs && !PlayVideoPayload(payload + PesPayloadOffset(payload),
+				length - PesPayloadOffset(payload),
+				PesHasPts(payload) ? PesGetPts(payload) : OMX_INVALID_PTS,
+				false, true))
+			ret = 0;
+
+		if (m_directTs && ret && Transferring())
+			AdjustLiveSpeed();
+
+		m_mutex->Unlock();
+
+		if (!m_directTs)
+			return PlayTsVideoFallback(Data, Length, length);
+
+		return ret;
+	}
+
+	if (!m_directTs)
+		return PlayTsVideoFallback(Data, Length, length);
+
+	if (m_hasVideo && !PollVideo())
+		return 0;
+
+	m_mutex->Lock();
+	bool hasVideo = m_hasVideo;
+	bool decodeOnly = m_decodeOnly;
+	int generation = m_videoGeneration;
 	m_mutex->Unlock();
 
-	if (Transferring() && !ret)
-		DBG("failed to write %d bytes of video packet!", Length);
+	if (hasVideo && !WriteVideo(payload, length, OMX_INVALID_PTS, false, true,
+			decodeOnly, generation))
+	{
+		DBG("failed to write %d bytes of video TS packet!", length);
+		return 0;
+	}
+	return Length;
+}
 
-	if (ret && Transferring())
-		AdjustLiveSpeed();
+// VDR's TS to PES assembly, the payload is counted as copied like the one
+// written by WriteVideo()
+int cOmxDevice::PlayTsVideoFallback(const uchar *Data, int Length,
+		int payloadLength)
+{
+	m_videoMutex->Lock();
+	m_copiedBytes += payloadLength;
+	m_videoMutex->Unlock();
 
-	return ret;
+	return cDevice::PlayTsVideo(Data, Length);
 }
+#endif
 
 bool cOmxDevice::SubmitEOS(void)
 {
@@ -473,10 +1081,37 @@ bool cOmxDevice::SubmitEOS(void)
 
 int64_t cOmxDevice::GetSTC(void)
 {
-	int64_t stc = m_omx->GetSTC();
+	int64_t stc = m_omx->GetCachedSTC();
+
+	m_mutex->Lock();
 	if (stc != OMX_INVALID_PTS)
+	{
 		m_lastStc = stc;
-	return m_lastStc & MAX33BIT;
+
+		if (m_seekStart && m_seekTargetStc != OMX_INVALID_PTS &&
+				stc >= m_seekTargetStc)
+		{
+			DLOG("seek to display: %llums, %d decode-only pictures",
+					cTimeMs::Now() - m_seekStart, m_decodeOnlyPictures);
+			m_seekStart = 0;
+		}
+	}
+
+	// the clock runs on the rebased time line, report the STC in time of the
+	// stream with the offset of the data being presented
+	stc = (m_lastStc - (m_lastStc < m_ptsOffsetStart ?
+			m_prevPtsOffset : m_ptsOffset)) & MAX33BIT;
+
+#ifdef DEBUG
+	if (m_ptsOffset && m_playbackSpeed == eNormal && m_direction == eForward &&
+			(m_hasVideo || m_hasAudio) && llabs(PtsDiff(stc, m_hasVideo ?
+			(m_videoPts - m_videoPtsOffset) & MAX33BIT :
+			(m_audioPts - m_audioPtsOffset) & MAX33BIT)) > STC_MAX_LAG)
+		DBG("STC %lld not on stream time line after rebase!", stc);
+#endif
+	m_mutex->Unlock();
+
+	return stc;
 }
 
 uchar *cOmxDevice::GrabImage(int &Size, bool Jpeg, int Quality,
@@ -492,38 +1127,56 @@ uchar *cOmxDevice::GrabImage(int &Size, bool Jpeg, int Quality,
 	SizeY = (SizeY > 0) ? SizeY : height;
 	Quality = (Quality >= 0) ? Quality : 100;
 
-	// bigger than needed, but uint32_t ensures proper alignment
-	uint8_t* frame = (uint8_t*)(MALLOC(uint32_t, SizeX * SizeY));
-
-	if (!frame)
+	if (Jpeg)
 	{
-		ELOG("failed to allocate image buffer!");
-		return ret;
-	}
+		m_grabMutex->Lock();
 
-	if (cRpiDisplay::Snapshot(frame, SizeX, SizeY))
-	{
-		ELOG("failed to grab image!");
-		free(frame);
-		return ret;
-	}
+		// keep the image buffer for subsequent grabs, bigger than needed,
+		// but uint32_t ensures proper alignment
+		if (m_grabBufferSize < SizeX * SizeY)
+		{
+			free(m_grabBuffer);
+			m_grabBuffer = (uint8_t*)(MALLOC(uint32_t, SizeX * SizeY));
+			m_grabBufferSize = m_grabBuffer ? SizeX * SizeY : 0;
+		}
 
-	if (Jpeg)
-		ret = RgbToJpeg(frame, SizeX, SizeY, Size, Quality);
+		if (!m_grabBuffer)
+			ELOG("failed to allocate image buffer!");
+		else if (cRpiDisplay::Snapshot(m_grabBuffer, SizeX, SizeY,
+				cRpiSetup::IsGrabVideoOnly()))
+			ELOG("failed to grab image!");
+		else
+		{
+			ret = cRpiJpegEncoder::Encode(m_grabBuffer, SizeX, SizeY, Quality,
+					Size);
+			if (!ret)
+				ret = RgbToJpeg(m_grabBuffer, SizeX, SizeY, Size, Quality);
+		}
+
+		m_grabMutex->Unlock();
+	}
 	else
 	{
+		// grab directly into the PNM image behind its header
 		char buf[32];
 		snprintf(buf, sizeof(buf), "P6\n%d\n%d\n255\n", SizeX, SizeY);
 		int l = strlen(buf);
 		Size = l + SizeX * SizeY * 3;
 		ret = MALLOC(uint8_t, Size);
-		if (ret)
+		if (!ret)
+			ELOG("failed to allocate image buffer!");
+		else
 		{
 			memcpy(ret, buf, l);
-			memcpy(ret + l, frame, SizeX * SizeY * 3);
+			if (cRpiDisplay::Snapshot(ret + l, SizeX, SizeY,
+					cRpiSetup::IsGrabVideoOnly()))
+			{
+				ELOG("failed to grab image!");
+				free(ret);
+				ret = NULL;
+			}
 		}
 	}
-	free(frame);
 	return ret;
 }
 
@@ -637,49 +1290,311 @@ bool cOmxDevice::HasIBPTrickSpeed(void)
 	return !m_hasVideo;
 }
 
+// tear down the video pipeline and release the decoder's input buffers for
+// audio only playback, it will be set up again with the next video packet.
+// must be called with m_mutex locked
+void cOmxDevice::ReleaseVideo(void)
+{
+	int gpuMem = cRpiSetup::GetFreeGpuMemory();
+	uint64_t start = cTimeMs::Now();
+
+	m_videoMutex->Lock();
+	m_videoGeneration++;
+	SubmitPendingVideo(false);
+	m_omx->FlushVideo(true);
+	m_videoMutex->Unlock();
+	m_omx->StopVideo();
+
+	m_hasVideo = false;
+	m_videoCodec = cVideoCodec::eInvalid;
+	m_playMode = pmAudioOnly;
+	m_decodeOnly = false;
+
+	DLOG("no video for %llums, video pipeline released in %llums, "
+			"free GPU memory %dM -> %dM", start - m_lastVideo,
+			cTimeMs::Now() - start, gpuMem, cRpiSetup::GetFreeGpuMemory());
+}
+
+void cOmxDevice::SetSeekTarget(int64_t pts)
+{
+	m_mutex->Lock();
+	DBG("SetSeekTarget(%lld)", pts);
+
+	ResetSeekTarget();
+	if (pts != OMX_INVALID_PTS)
+	{
+		m_seekTarget = pts & MAX33BIT;
+		m_seekStart = cTimeMs::Now();
+	}
+	m_mutex->Unlock();
+}
+
+// drop a pending seek target and stop flagging pictures as decode-only, must
+// be called with m_mutex locked
+void cOmxDevice::ResetSeekTarget(void)
+{
+	m_seekTarget = OMX_INVALID_PTS;
+	m_seekTargetStc = OMX_INVALID_PTS;
+	m_seekStart = 0;
+	m_seekLastPts = OMX_INVALID_PTS;
+	m_decodeOnly = false;
+	m_decodeOnlyPictures = 0;
+}
+
+// decide whether the picture starting with the given PES time stamp is to be
+// decoded only, pictures without time stamp follow the previous decision.
+// the target is kept for a while after it has been reached, since pictures
+// in decoding order may still precede it. must be called with m_mutex locked
+void cOmxDevice::UpdateSeekTarget(int64_t pts)
+{
+	// a packet retried by VDR is counted once
+	if (pts == OMX_INVALID_PTS || pts == m_seekLastPts)
+		return;
+
+	m_seekLastPts = pts;
+	int64_t distance = PtsDiff(pts, m_seekTarget);
+
+	if (m_trickRequest || m_playbackSpeed != eNormal ||
+			m_direction != eForward || distance > SEEK_MAX_DISTANCE)
+	{
+		DBG("seek target dropped");
+		ResetSeekTarget();
+		return;
+	}
+
+	m_decodeOnly = distance > 0;
+	if (m_decodeOnly)
+		m_decodeOnlyPictures++;
+
+	else if (m_seekTargetStc == OMX_INVALID_PTS)
+	{
+		DBG("seek target reached after %d decode-only pictures",
+				m_decodeOnlyPictures);
+		m_seekTargetStc = m_videoPts + PtsDiff(
+				(m_videoPts - m_videoPtsOffset) & MAX33BIT, m_seekTarget);
+	}
+
+	if (distance < -SEEK_REORDER_DISTANCE)
+	{
+		m_seekTarget = OMX_INVALID_PTS;
+		m_decodeOnly = false;
+	}
+}
+
+// distance from the given time stamp to a pending seek target in ms, used to
+// start the clock at the target instead of the preceding intra picture
+int cOmxDevice::SeekDistance(int64_t pts)
+{
+	if (m_seekTarget == OMX_INVALID_PTS || m_trickRequest ||
+			m_playbackSpeed != eNormal || m_direction != eForward)
+		return 0;
+
+	int64_t distance = PtsDiff(pts, m_seekTarget);
+	return distance > 0 && distance <= SEEK_MAX_DISTANCE ? distance / 90 : 0;
+}
+
+int cOmxDevice::PreRoll(void)
+{
+	if (!Transferring())
+		return PRE_ROLL_PLAYBACK;
+
+	int preRoll = m_livePreRoll->PreRoll();
+	return preRoll ? preRoll : cRpiSetup::GetLiveLatency();
+}
+
+// no audio for this channel, start clock on video. must be called with
+// m_mutex locked
+
+void cOmxDevice::CheckAudioFirstTimeout(void)
+{
+	if (m_waitForAudio &&
+			cTimeMs::Now() - m_waitForAudio > AUDIO_FIRST_TIMEOUT)
+	{
+		DBG("no audio, starting clock on video");
+		m_waitForAudio = 0;
+		m_omx->StartClock(m_hasVideo, m_hasAudio, PreRoll());
+	}
+}
+
+// returns false if the video buffers are full. nothing is taken from them
+// while the clock waits for audio, so the timeout is checked here too,
+// otherwise the video data would never get to PrepareVideo()
+
+bool cOmxDevice::PollVideo(void)
+{
+	if (m_omx->PollVideo())
+		return true;
+
+	m_mutex->Lock();
+	CheckAudioFirstTimeout();
+	m_mutex->Unlock();
+	return false;
+}
+
+// must be called with m_mutex locked
+
 void cOmxDevice::AdjustLiveSpeed(void)
 {
+	if (m_releaseFirstPicture)
+	{
+		if (cTimeMs::Now() < m_releaseFirstPicture)
+			return;
+
+		m_releaseFirstPicture = 0;
+		m_omx->SetClockScale(S(1.0f));
+
+		if (m_zapStart)
+			DLOG("zap to smooth motion: %llums", cTimeMs::Now() - m_zapStart);
+		m_zapStart = 0;
+	}
+
 	if (m_timer->TimedOut())
 	{
-		int usedBuffers, usedAudioBuffers, usedVideoBuffers;
-		m_omx->GetBufferUsage(usedAudioBuffers, usedVideoBuffers);
-		usedBuffers = m_hasAudio ? usedAudioBuffers : usedVideoBuffers;
+		m_timer->Set(LIVE_SPEED_INTERVAL);
+
+		int audioMs, videoMs;
+		if (!m_omx->GetBufferDuration(audioMs, videoMs))
+			return;
+
+		// an empty buffer while the clock is running is an underrun
+		int bufferedMs = m_hasAudio ? audioMs : videoMs;
+		m_livePreRoll->Update(bufferedMs);
+		if (!bufferedMs)
+			return;
 
-		if (usedBuffers < 5)
-			m_liveSpeed = eNegCorrection;
+		int errorMs = bufferedMs - PreRoll();
 
-		else if (usedBuffers > 15)
-			m_liveSpeed = ePosCorrection;
+		// PI controller, the clock is sped up if more than the target
+		// latency is buffered, integral term is limited to avoid wind-up.
+		// small errors still add up, since the integral is kept in ms
+		m_liveSpeedIntegral = constrain(m_liveSpeedIntegral + errorMs,
+				-LIVE_SPEED_MAX_CORRECTION * LIVE_SPEED_I_DIVISOR,
+				LIVE_SPEED_MAX_CORRECTION * LIVE_SPEED_I_DIVISOR);
 
-		else if ((usedBuffers > 10 && m_liveSpeed == eNegCorrection) ||
-				(usedBuffers < 10 && m_liveSpeed == ePosCorrection))
-			m_liveSpeed = eNoCorrection;
+		m_liveSpeedCorrection = constrain(errorMs / LIVE_SPEED_P_DIVISOR +
+				m_liveSpeedIntegral / LIVE_SPEED_I_DIVISOR,
+				-LIVE_SPEED_MAX_CORRECTION, LIVE_SPEED_MAX_CORRECTION);
 
 #ifdef DEBUG_BUFFERSTAT
-		DLOG("buffer usage: A=%3d%%, V=%3d%%, Corr=%d",
-				usedAudioBuffers, usedVideoBuffers,
-				m_liveSpeed == eNegMaxCorrection ? -2 :
-				m_liveSpeed == eNegCorrection    ? -1 :
-				m_liveSpeed == eNoCorrection     ?  0 :
-				m_liveSpeed == ePosCorrection    ?  1 :
-				m_liveSpeed == ePosMaxCorrection ?  2 : 0);
+		int usedAudioBuffers, usedVideoBuffers, inputAudioMs, inputVideoMs;
+		int minAudioBuffers, minVideoBuffers, maxAudioBuffers, maxVideoBuffers;
+		m_omx->GetBufferUsage(usedAudioBuffers, usedVideoBuffers);
+		m_omx->GetBufferUsage(minAudioBuffers, minVideoBuffers, 0);
+		m_omx->GetBufferUsage(maxAudioBuffers, maxVideoBuffers, 100);
+		m_omx->GetInputBufferDuration(inputAudioMs, inputVideoMs);
+		DLOG("buffer usage: A=%3d%% (%3d-%3d%%) %4dms (%4dms input), "
+				"V=%3d%% (%3d-%3d%%) %4dms (%4dms input), Corr=%dppm",
+				usedAudioBuffers, minAudioBuffers, maxAudioBuffers,
+				audioMs, inputAudioMs,
+				usedVideoBuffers, minVideoBuffers, maxVideoBuffers,
+				videoMs, inputVideoMs, m_liveSpeedCorrection);
+
+		uint64_t now = cTimeMs::Now();
+		m_videoMutex->Lock();
+		if (m_copyStatTime && now > m_copyStatTime)
+			DLOG("video data copied: %llukB/s",
+					m_copiedBytes / (now - m_copyStatTime));
+
+		m_copiedBytes = 0;
+		m_copyStatTime = now;
+		m_videoMutex->Unlock();
 #endif
-		m_omx->SetClockScale(s_liveSpeeds[m_liveSpeed]);
-		m_timer->Set(1000);
+		m_omx->SetClockScale(S(1.0f) +
+				(int)(m_liveSpeedCorrection * 65536LL / 1000000));
 	}
 }
 
+// rebase time stamps after a discontinuity, so the OMX clock keeps running on
+// a continuous time line. the stream running into the discontinuity first
+// sets the common offset, the other stream adopts it when it gets there. a
+// jump which still matches the other stream's time stamps is a gap in this
+// stream only, e.g. an audio dropout, and keeps the time line
+
+void cOmxDevice::RebasePts(int64_t streamPts, int64_t &offset, int step,
+		int64_t pts, int64_t &ptsDiff, bool hasOther, int64_t otherPts,
+		int64_t otherOffset)
+{
+	if (offset != m_ptsOffset)
+	{
+		int64_t diff = PtsDiff((streamPts - m_ptsOffset) & MAX33BIT, pts);
+		if (llabs(diff) <= PTS_DISCONTINUITY_THRESHOLD)
+		{
+			offset = m_ptsOffset;
+			ptsDiff = diff;
+			return;
+		}
+	}
+
+	if (hasOther && llabs(PtsDiff((otherPts - otherOffset) & MAX33BIT, pts))
+			<= PTS_DISCONTINUITY_THRESHOLD)
+	{
+		DLOG("PTS gap of %lldms in one stream, keeping time stamps",
+				ptsDiff / 90);
+		return;
+	}
+
+	DLOG("PTS discontinuity of %lldms, rebasing time stamps", ptsDiff / 90);
+	offset += step - ptsDiff;
+	ptsDiff = step;
+
+	// pictures before the rebased time stamp are still shown with the
+	// previous offset, see GetSTC()
+	m_prevPtsOffset = m_ptsOffset;
+	m_ptsOffsetStart = streamPts + step;
+	m_ptsOffset = offset;
+}
+
 void cOmxDevice::HandleBufferStall()
 {
-	ELOG("buffer stall!");
 	m_mutex->Lock();
 
-	FlushStreams(true);
-	m_omx->StopVideo();
+	// start with the cheapest recovery and escalate only if the stall
+	// persists after the previous attempt
+	uint64_t now = cTimeMs::Now();
+	m_stallRecovery = m_lastStall && now - m_lastStall < BUFFER_STALL_ESCALATION ?
+			(eStallRecovery)std::min(m_stallRecovery + 1, (int)eResetPipeline) :
+			eRestartClock;
 
-	m_hasAudio = false;
-	m_hasVideo = false;
-	m_videoCodec = cVideoCodec::eInvalid;
+	ELOG("buffer stall, %s!", StallRecoveryStr(m_stallRecovery));
+	m_livePreRoll->Underrun();
+
+	switch (m_stallRecovery)
+	{
+	case eRestartClock:
+		m_waitForAudio = 0;
+		m_omx->StopClock();
+		m_omx->ResetClock();
+		m_omx->SetClockScale(s_playbackSpeeds[m_direction][m_playbackSpeed]);
+		m_omx->StartClock(m_hasVideo, m_hasAudio, PreRoll());
+		break;
+
+	case eFlushDecoder:
+		FlushStreams();
+		m_omx->SetClockScale(s_playbackSpeeds[m_direction][m_playbackSpeed]);
+		m_omx->StartClock(m_hasVideo, m_hasAudio, PreRoll());
+		break;
+
+	default:
+	case eResetPipeline:
+		FlushStreams(true);
+		m_omx->StopVideo();
+
+		m_hasAudio = false;
+		m_hasVideo = false;
+		m_videoCodec = cVideoCodec::eInvalid;
+		break;
+	}
+
+	m_lastStall = cTimeMs::Now();
+	m_stallRecoveries[m_stallRecovery]++;
+	m_stallRecoveryTime[m_stallRecovery] += m_lastStall - now;
+
+	DLOG("stall recoveries: clock %d (%llums), decoder %d (%llums), "
+			"pipeline %d (%llums)",
+			m_stallRecoveries[eRestartClock], m_stallRecoveryTime[eRestartClock],
+			m_stallRecoveries[eFlushDecoder], m_stallRecoveryTime[eFlushDecoder],
+			m_stallRecoveries[eResetPipeline],
+			m_stallRecoveryTime[eResetPipeline]);
 
 	m_mutex->Unlock();
 }
@@ -689,11 +1604,17 @@ void cOmxDevice::HandleEndOfStream()
 	DBG("HandleEndOfStream()");
 	m_mutex->Lock();
 
+	if (m_stillPictureStart)
+	{
+		DBG("still picture displayed after %llums",
+				cTimeMs::Now() - m_stillPictureStart);
+		m_stillPictureStart = 0;
+	}
+
 	// flush pipes and restart clock after still image
 	FlushStreams();
 	m_omx->SetClockScale(s_playbackSpeeds[m_direction][m_playbackSpeed]);
-	m_omx->StartClock(m_hasVideo, m_hasAudio,
-			Transferring() ? PRE_ROLL_LIVE : PRE_ROLL_PLAYBACK);
+	m_omx->StartClock(m_hasVideo, m_hasAudio, PreRoll());
 
 	m_mutex->Unlock();
 }
@@ -711,6 +1632,27 @@ void cOmxDevice::HandleStreamStart()
 	HandleVideoSetupChanged();
 }
 
+// called when the video render has been enabled for the first picture, which
+// happens on each channel switch, since the video pipeline is stopped with
+// the transfer player
+
+void cOmxDevice::HandleFirstPicture()
+{
+	DBG("HandleFirstPicture()");
+
+	m_mutex->Lock();
+	if (m_zapStart)
+	{
+		DLOG("zap to first picture: %llums", cTimeMs::Now() - m_zapStart);
+		if (!m_releaseFirstPicture)
+		{
+			DLOG("zap to smooth motion: %llums", cTimeMs::Now() - m_zapStart);
+			m_zapStart = 0;
+		}
+	}
+	m_mutex->Unlock();
+}
+
 void cOmxDevice::HandleVideoSetupChanged()
 {
 	// apply framing parameters
@@ -754,10 +1696,28 @@ void cOmxDevice::FlushStreams(bool flushVideoRender)
 {
 	DBG("FlushStreams(%s)", flushVideoRender ? "flushVideoRender" : "");
 	m_omx->StopClock();
+	m_waitForAudio = 0;
+	m_releaseFirstPicture = 0;
+
+	// a pending seek target is kept for the data following the flush, but
+	// its decision is taken again
+	m_seekLastPts = OMX_INVALID_PTS;
+	m_decodeOnly = false;
+	m_liveSpeedCorrection = 0;
+	m_liveSpeedIntegral = 0;
+
+	// wait for a running copy to the decoder, data prepared before is dropped
+	// and the pending buffer is passed to the decoder to be discarded
+	m_videoMutex->Lock();
+	m_videoGeneration++;
+	SubmitPendingVideo(false);
+	m_directTs = false;
 
 	if (m_hasVideo)
 		m_omx->FlushVideo(flushVideoRender);
 
+	m_videoMutex->Unlock();
+
 	if (m_hasAudio)
 		m_audio->Reset();
 
@@ -831,3 +1791,458 @@ cVideoCodec::eCodec cOmxDevice::ParseVideoCodec(const uchar *data, int length)
 	}
 	return cVideoCodec::eInvalid;
 }
+
+// copy the payload of a NAL unit up to the next start code and remove the
+// emulation prevention bytes, returns the length of the copy
+
+static int UnescapeNalUnit(const uchar *data, int length, uchar *nal, int size)
+{
+	int nalLength = 0;
+	for (int j = 0; j < length && nalLength < size; j++)
+	{
+		if (j + 2 < length && !data[j] && !data[j + 1])
+		{
+			if (data[j + 2] == 0x03)
+			{
+				nal[nalLength++] = 0;
+				if (nalLength < size)
+					nal[nalLength++] = 0;
+				j += 2;
+				continue;
+			}
+			if (data[j + 2] <= 0x01)
+				break;
+		}
+		nal[nalLength++] = data[j];
+	}
+	return nalLength;
+}
+
+// the scan mode is only set if it's known from the stream headers, otherwise
+// the format is progressive and the decoder's port settings tell later
+
+bool cOmxDevice::ParseVideoFrameFormat(cVideoCodec::eCodec codec,
+		const uchar *data, int length, cVideoFrameFormat &format,
+		bool &scanModeKnown)
+{
+	scanModeKnown = false;
+	for (int i = 0; i + 4 < length; i++)
+	{
+		if (data[i] || data[i + 1] || data[i + 2] != 0x01)
+			continue;
+
+		if (codec == cVideoCodec::eMPEG2 && data[i + 3] == 0xb3)
+			return ParseMpeg2SequenceHeader(data + i + 4, length - i - 4,
+					format, scanModeKnown);
+
+		if (codec == cVideoCodec::eH264 && (data[i + 3] & 0x1f) == 7)
+		{
+			uchar nal[512];
+			int picStructOffset = -1;
+			if (!ParseH264SequenceParameterSet(nal, UnescapeNalUnit(
+					data + i + 4, length - i - 4, nal, sizeof(nal)),
+					format, scanModeKnown, picStructOffset))
+				return false;
+
+			// field coded streams may still be progressive, look for the
+			// picture timing of the first picture in the same access unit
+			for (int j = i + 4; !scanModeKnown && picStructOffset >= 0 &&
+					j + 4 < length; j++)
+			{
+				if (data[j] || data[j + 1] || data[j + 2] != 0x01)
+					continue;
+
+				int type = data[j + 3] & 0x1f;
+				if (type == 1 || type == 5)		// first slice
+					break;
+
+				if (type == 6)					// SEI
+				{
+					cScanMode::eMode scanMode;
+					if (ParseH264PictureTiming(nal, UnescapeNalUnit(
+							data + j + 4, length - j - 4, nal, sizeof(nal)),
+							picStructOffset, scanMode))
+					{
+						format.scanMode = scanMode;
+						scanModeKnown = true;
+					}
+				}
+			}
+			if (format.Interlaced())
+				format.frameRate *= 2;
+
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * ISO/IEC 13818-2, 6.2.2.1 sequence header and 6.2.2.3 sequence extension
+ */
+
+bool cOmxDevice::ParseMpeg2SequenceHeader(const uchar *data, int length,
+		cVideoFrameFormat &format, bool &scanModeKnown)
+{
+	cBitStream bs(data, length);
+
+	int width = bs.GetBits(12);
+	int height = bs.GetBits(12);
+	int aspectRatio = bs.GetBits(4);
+	int frameRateCode = bs.GetBits(4);
+	bs.SkipBits(18 + 1 + 10 + 1);	// bit rate, marker, vbv buffer, constr.
+
+	if (bs.GetBit())				// load intra quantiser matrix
+		bs.SkipBits(8 * 64);
+	if (bs.GetBit())				// load non intra quantiser matrix
+		bs.SkipBits(8 * 64);
+
+	if (bs.EOS() || !width || !height || frameRateCode < 1 || frameRateCode > 8)
+		return false;
+
+	static const int frameRates[9][2] = {
+		{ 0, 1 }, { 24000, 1001 }, { 24, 1 }, { 25, 1 }, { 30000, 1001 },
+		{ 30, 1 }, { 50, 1 }, { 60000, 1001 }, { 60, 1 }
+	};
+	int frameRateNum = frameRates[frameRateCode][0];
+	int frameRateDen = frameRates[frameRateCode][1];
+
+	// the sequence extension follows directly and is mandatory for MPEG-2,
+	// without it the stream is MPEG-1 and progressive
+	bool progressive = true;
+	for (int i = 8; i + 9 < length; i++)
+	{
+		if (!data[i] && !data[i + 1] && data[i + 2] == 0x01)
+		{
+			if (data[i + 3] != 0xb5)
+				break;
+
+			cBitStream ext(data + i + 4, length - i - 4);
+			if (ext.GetBits(4) != 1)		// sequence extension id
+				break;
+
+			ext.SkipBits(8);				// profile and level
+			progressive = ext.GetBit();
+			ext.SkipBits(2);				// chroma format
+			width |= ext.GetBits(2) << 12;
+			height |= ext.GetBits(2) << 12;
+			ext.SkipBits(12 + 1 + 8 + 1);	// bit rate, marker, vbv, low delay
+			frameRateNum *= ext.GetBits(2) + 1;
+			frameRateDen *= ext.GetBits(5) + 1;
+			break;
+		}
+	}
+
+	format.width = width;
+	format.height = height;
+	format.scanMode = cScanMode::eProgressive;
+	scanModeKnown = progressive;
+
+	// the field order of interlaced sequences is given by the picture coding
+	// extension of the first picture, 6.2.3.1
+	for (int i = 8; !scanModeKnown && i + 7 < length; i++)
+	{
+		if (data[i] || data[i + 1] || data[i + 2] != 0x01 ||
+				data[i + 3] != 0xb5 || (data[i + 4] >> 4) != 8)
+			continue;
+
+		cBitStream ext(data + i + 4, length - i - 4);
+		ext.SkipBits(4 + 16 + 2);		// id, f_code, intra_dc_precision
+		int pictureStructure = ext.GetBits(2);
+		bool topFieldFirst = ext.GetBit();
+
+		format.scanMode = pictureStructure == 2 || (pictureStructure == 3 &&
+				!topFieldFirst) ? cScanMode::eBottomFieldFirst :
+						cScanMode::eTopFieldFirst;
+		scanModeKnown = true;
+	}
+
+	// round up to the next integer, as done for the decoder's frame rate
+	format.frameRate = (frameRateNum + frameRateDen - 1) / frameRateDen;
+	if (format.Interlaced())
+		format.frameRate *= 2;
+
+	// derive pixel aspect ratio from display aspect ratio
+	cRational par(1, 1);
+	switch (aspectRatio)
+	{
+	case 2: par = cRational(4 * height, 3 * width);     break;
+	case 3: par = cRational(16 * height, 9 * width);    break;
+	case 4: par = cRational(221 * height, 100 * width); break;
+	default: break;
+	}
+	par.Reduce(1000);
+	format.pixelWidth = par.num;
+	format.pixelHeight = par.den;
+
+	return true;
+}
+
+/*
+ * ITU-T H.264, 7.3.2.1 sequence parameter set and E.1.1 VUI parameters
+ */
+
+bool cOmxDevice::ParseH264SequenceParameterSet(const uchar *data, int length,
+		cVideoFrameFormat &format, bool &scanModeKnown, int &picStructOffset)
+{
+	cBitStream bs(data, length);
+
+	int profile = bs.GetBits(8);
+	bs.SkipBits(16);				// constraint flags, level
+	bs.GetUeGolomb();				// seq_parameter_set_id
+
+	int chromaFormat = 1;
+	if (profile == 100 || profile == 110 || profile == 122 ||
+			profile == 244 || profile == 44 || profile == 83 ||
+			profile == 86 || profile == 118 || profile == 128 ||
+			profile == 138 || profile == 139 || profile == 134)
+	{
+		chromaFormat = bs.GetUeGolomb();
+		if (chromaFormat == 3)
+			bs.SkipBits(1);			// separate_colour_plane_flag
+		bs.GetUeGolomb();			// bit_depth_luma_minus8
+		bs.GetUeGolomb();			// bit_depth_chroma_minus8
+		bs.SkipBits(1);				// qpprime_y_zero_transform_bypass_flag
+
+		if (bs.GetBit())			// seq_scaling_matrix_present_flag
+		{
+			for (int i = 0; i < (chromaFormat != 3 ? 8 : 12); i++)
+			{
+				if (bs.GetBit())	// seq_scaling_list_present_flag
+				{
+					int last = 8, next = 8;
+					for (int j = 0; j < (i < 6 ? 16 : 64) && next; j++)
+					{
+						next = (last + bs.GetSeGolomb() + 256) % 256;
+						last = next ? next : last;
+					}
+				}
+			}
+		}
+	}
+
+	bs.GetUeGolomb();				// log2_max_frame_num_minus4
+	int pocType = bs.GetUeGolomb();
+	if (pocType == 0)
+		bs.GetUeGolomb();			// log2_max_pic_order_cnt_lsb_minus4
+	else if (pocType == 1)
+	{
+		bs.SkipBits(1);				// delta_pic_order_always_zero_flag
+		bs.GetSeGolomb();			// offset_for_non_ref_pic
+		bs.GetSeGolomb();			// offset_for_top_to_bottom_field
+		int n = bs.GetUeGolomb();
+		for (int i = 0; i < n && !bs.EOS(); i++)
+			bs.GetSeGolomb();		// offset_for_ref_frame
+	}
+
+	bs.GetUeGolomb();				// max_num_ref_frames
+	bs.SkipBits(1);					// gaps_in_frame_num_value_allowed_flag
+	int widthMbs = bs.GetUeGolomb() + 1;
+	int heightMapUnits = bs.GetUeGolomb() + 1;
+	bool frameMbsOnly = bs.GetBit();
+	if (!frameMbsOnly)
+		bs.SkipBits(1);				// mb_adaptive_frame_field_flag
+	bs.SkipBits(1);					// direct_8x8_inference_flag
+
+	int width = widthMbs * 16;
+	int height = (frameMbsOnly ? 1 : 2) * heightMapUnits * 16;
+
+	if (bs.GetBit())				// frame_cropping_flag
+	{
+		int cropX = chromaFormat == 1 || chromaFormat == 2 ? 2 : 1;
+		int cropY = (chromaFormat == 1 ? 2 : 1) * (frameMbsOnly ? 1 : 2);
+		width -= cropX * bs.GetUeGolomb();
+		width -= cropX * bs.GetUeGolomb();
+		height -= cropY * bs.GetUeGolomb();
+		height -= cropY * bs.GetUeGolomb();
+	}
+
+	// without VUI, frame rate and aspect ratio are unknown
+	if (!bs.GetBit() || bs.EOS())	// vui_parameters_present_flag
+		return false;
+
+	static const int pixelAspectRatios[17][2] = {
+		{  0,  1 }, {   1,  1 }, { 12, 11 }, { 10, 11 }, { 16, 11 },
+		{ 40, 33 }, {  24, 11 }, { 20, 11 }, { 32, 11 }, { 80, 33 },
+		{ 18, 11 }, {  15, 11 }, { 64, 33 }, {160, 99 }, {  4,  3 },
+		{  3,  2 }, {   2,  1 }
+	};
+
+	int parNum = 0, parDen = 1;
+	if (bs.GetBit())				// aspect_ratio_info_present_flag
+	{
+		int aspectRatio = bs.GetBits(8);
+		if (aspectRatio == 255)		// Extended_SAR
+		{
+			parNum = bs.GetBits(16);
+			parDen = bs.GetBits(16);
+		}
+		else if (aspectRatio < 17)
+		{
+			parNum = pixelAspectRatios[aspectRatio][0];
+			parDen = pixelAspectRatios[aspectRatio][1];
+		}
+	}
+
+	if (bs.GetBit())				// overscan_info_present_flag
+		bs.SkipBits(1);				// overscan_appropriate_flag
+
+	if (bs.GetBit())				// video_signal_type_present_flag
+	{
+		bs.SkipBits(3 + 1);			// video_format, video_full_range_flag
+		if (bs.GetBit())			// colour_description_present_flag
+			bs.SkipBits(8 + 8 + 8);
+	}
+
+	if (bs.GetBit())				// chroma_loc_info_present_flag
+	{
+		bs.GetUeGolomb();
+		bs.GetUeGolomb();
+	}
+
+	if (!bs.GetBit())				// timing_info_present_flag
+		return false;
+
+	uint32_t unitsInTick = bs.GetBits(32);
+	uint32_t timeScale = bs.GetBits(32);
+	bs.SkipBits(1);					// fixed_frame_rate_flag
+
+	// the picture timing SEI starts with the HRD delays, if any
+	int delayBits = 0;
+	bool hrdPresent = false;
+	for (int hrd = 0; hrd < 2; hrd++)
+	{
+		if (!bs.GetBit())			// nal/vcl_hrd_parameters_present_flag
+			continue;
+
+		hrdPresent = true;
+		int cpbCount = bs.GetUeGolomb() + 1;
+		bs.SkipBits(4 + 4);			// bit_rate_scale, cpb_size_scale
+		for (int i = 0; i < cpbCount && !bs.EOS(); i++)
+		{
+			bs.GetUeGolomb();		// bit_rate_value_minus1
+			bs.GetUeGolomb();		// cpb_size_value_minus1
+			bs.SkipBits(1);			// cbr_flag
+		}
+		bs.SkipBits(5);				// initial_cpb_removal_delay_length
+		delayBits = bs.GetBits(5) + 1;
+		delayBits += bs.GetBits(5) + 1;
+		bs.SkipBits(5);				// time_offset_length
+	}
+	if (hrdPresent)
+		bs.SkipBits(1);				// low_delay_hrd_flag
+
+	if (bs.GetBit() && !bs.EOS())	// pic_struct_present_flag
+		picStructOffset = delayBits;
+
+	if (bs.EOS() || !unitsInTick || !timeScale || !parNum || !parDen ||
+			width <= 0 || height <= 0)
+		return false;
+
+	// field coded pictures don't tell whether the content is interlaced
+	format.width = width;
+	format.height = height;
+	format.scanMode = cScanMode::eProgressive;
+	scanModeKnown = frameMbsOnly;
+
+	// time scale is given in fields, round up to the next integer as done
+	// for the decoder's frame rate
+	format.frameRate = (timeScale + 2 * unitsInTick - 1) / (2 * unitsInTick);
+
+	cRational par(parNum, parDen);
+	par.Reduce(1000);
+	format.pixelWidth = par.num;
+	format.pixelHeight = par.den;
+
+	return true;
+}
+
+/*
+ * ITU-T H.264, 7.3.2.3 SEI and D.1.3 picture timing SEI
+ */
+
+bool cOmxDevice::ParseH264PictureTiming(const uchar *data, int length,
+		int picStructOffset, cScanMode::eMode &scanMode)
+{
+	int i = 0;
+	while (i + 2 < length && data[i] != 0x80)	// rbsp_trailing_bits
+	{
+		int type = 0, size = 0;
+		while (i < length && data[i] == 0xff)
+			type += data[i++];
+		if (i < length)
+			type += data[i++];
+		while (i < length && data[i] == 0xff)
+			size += data[i++];
+		if (i < length)
+			size += data[i++];
+
+		if (i + size > length)
+			break;
+
+		if (type == 1)
+		{
+			cBitStream bs(data + i, size);
+			bs.SkipBits(picStructOffset);
+			int picStruct = bs.GetBits(4);
+			if (bs.EOS() || picStruct > 8)
+				return false;
+
+			// frame, top field first or bottom field first, table D-1
+			scanMode = picStruct == 0 || picStruct >= 7 ?
+					cScanMode::eProgressive :
+				picStruct == 1 || picStruct == 3 || picStruct == 5 ?
+					cScanMode::eTopFieldFirst : cScanMode::eBottomFieldFirst;
+			return true;
+		}
+		i += size;
+	}
+	return false;
+}
+
+cOmxDevice::ePictureType cOmxDevice::ParsePictureType(cVideoCodec::eCodec codec,
+		const uchar *data, int length)
+{
+	for (int i = 0; i + 5 < length; i++)
+	{
+		if (data[i] || data[i + 1] || data[i + 2] != 0x01)
+			continue;
+
+		if (codec == cVideoCodec::eMPEG2 && data[i + 3] == 0x00)
+		{
+			// picture header, ISO/IEC 13818-2, 6.2.3
+			switch ((data[i + 5] >> 3) & 0x07)
+			{
+			case 1:  return ePictureI;
+			case 2:  return ePictureP;
+			case 3:  return ePictureB;
+			default: return ePictureUnknown;
+			}
+		}
+		else if (codec == cVideoCodec::eH264)
+		{
+			switch (data[i + 3] & 0x1f)
+			{
+			case 5:	// IDR slice
+				return ePictureI;
+
+			case 1:	// non-IDR slice, ITU-T H.264, 7.3.3
+			{
+				cBitStream bs(data + i + 4, length - i - 4);
+				bs.GetUeGolomb();	// first_mb_in_slice
+				switch (bs.GetUeGolomb() % 5)
+				{
+				case 2: case 4:	return ePictureI;	// I, SI
+				case 0: case 3:	return ePictureP;	// P, SP
+				case 1:			return ePictureB;
+				}
+				return ePictureUnknown;
+			}
+
+			default:
+				break;
+			}
+		}
+	}
+	return ePictureUnknown;
+}
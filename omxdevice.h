@@ -64,8 +64,17 @@ public:
 
 	virtual int PlayVideo(const uchar *Data, int Length, bool EndOfFrame);
 
+#ifdef ENABLE_DIRECT_TS
+	virtual int PlayTsVideo(const uchar *Data, int Length);
+#endif
+
 	virtual int64_t GetSTC(void);
 
+	// show pictures starting at the given PTS only, the ones between the
+	// preceding intra picture and the target are decoded but not displayed.
+	// must be set after the device has been cleared for the new position
+	void SetSeekTarget(int64_t pts);
+
 	virtual uchar *GrabImage(int &Size, bool Jpeg = true, int Quality = -1,
 			int SizeX = -1, int SizeY = -1);
 
@@ -121,35 +130,60 @@ protected:
 				speed == eFastest ? "fastest" : "unknown";
 	}
 
-	enum eLiveSpeed {
-		eNegMaxCorrection,
-		eNegCorrection,
-		eNoCorrection,
-		ePosCorrection,
-		ePosMaxCorrection,
-		eNumLiveSpeeds
+	enum eStallRecovery {
+		eRestartClock,
+		eFlushDecoder,
+		eResetPipeline,
+		eNumStallRecoveries
 	};
 
-	static const char* LiveSpeedStr(eLiveSpeed corr) {
-		return	corr == eNegMaxCorrection ? "max negative" :
-				corr == eNegCorrection    ? "negative"     :
-				corr == eNoCorrection     ? "no"           :
-				corr == ePosCorrection    ? "positive"     :
-				corr == ePosMaxCorrection ? "max positive" : "unknown";
+	static const char* StallRecoveryStr(eStallRecovery recovery) {
+		return 	recovery == eRestartClock  ? "restart clock"  :
+				recovery == eFlushDecoder  ? "flush decoder"  :
+				recovery == eResetPipeline ? "reset pipeline" : "unknown";
+	}
+
+	enum ePictureType {
+		ePictureUnknown,
+		ePictureI,
+		ePictureP,
+		ePictureB
+	};
+
+	static const char* PictureTypeStr(ePictureType type) {
+		return	type == ePictureI ? "I" :
+				type == ePictureP ? "P" :
+				type == ePictureB ? "B" : "unknown";
 	}
 
 	static const int s_playbackSpeeds[eNumDirections][eNumPlaybackSpeeds];
-	static const int s_liveSpeeds[eNumLiveSpeeds];
 
-	static const uchar s_pesVideoHeader[14];
 	static const uchar s_mpeg2EndOfSequence[4];
 	static const uchar s_h264EndOfSequence[8];
+#ifdef ENABLE_DIRECT_TS
+	static const uchar s_tsPayloadStart[TS_SIZE];
+#endif
 
 private:
 
+	class cLivePreRoll;
+
 	void (*m_onPrimaryDevice)(void);
 	virtual cVideoCodec::eCodec ParseVideoCodec(const uchar *data, int length);
 
+	static bool ParseVideoFrameFormat(cVideoCodec::eCodec codec,
+			const uchar *data, int length, cVideoFrameFormat &format,
+			bool &scanModeKnown);
+	static bool ParseMpeg2SequenceHeader(const uchar *data, int length,
+			cVideoFrameFormat &format, bool &scanModeKnown);
+	static bool ParseH264SequenceParameterSet(const uchar *data, int length,
+			cVideoFrameFormat &format, bool &scanModeKnown,
+			int &picStructOffset);
+	static bool ParseH264PictureTiming(const uchar *data, int length,
+			int picStructOffset, cScanMode::eMode &scanMode);
+	static ePictureType ParsePictureType(cVideoCodec::eCodec codec,
+			const uchar *data, int length);
+
 	static void OnBufferStall(void *data)
 		{ (static_cast <cOmxDevice*> (data))->HandleBufferStall(); }
 
@@ -159,12 +193,16 @@ private:
 	static void OnStreamStart(void *data)
 		{ (static_cast <cOmxDevice*> (data))->HandleStreamStart(); }
 
+	static void OnFirstPicture(void *data)
+		{ (static_cast <cOmxDevice*> (data))->HandleFirstPicture(); }
+
 	static void OnVideoSetupChanged(void *data)
 		{ (static_cast <cOmxDevice*> (data))->HandleVideoSetupChanged(); }
 
 	void HandleBufferStall();
 	void HandleEndOfStream();
 	void HandleStreamStart();
+	void HandleFirstPicture();
 	void HandleVideoSetupChanged();
 
 	void FlushStreams(bool flushVideoRender = false);
@@ -172,33 +210,99 @@ private:
 
 	void ApplyTrickSpeed(int trickSpeed, bool forward);
 	void PtsTracker(int64_t ptsDiff);
-
+	void RebasePts(int64_t streamPts, int64_t &offset, int step,
+			int64_t pts, int64_t &ptsDiff, bool hasOther, int64_t otherPts,
+			int64_t otherOffset);
+
+	void ReleaseVideo(void);
+	int SeekDistance(int64_t pts);
+	void ResetSeekTarget(void);
+	void UpdateSeekTarget(int64_t pts);
+	int PreRoll(void);
 	void AdjustLiveSpeed(void);
+	void CheckAudioFirstTimeout(void);
+	bool PollVideo(void);
+
+	bool PlayVideoPayload(const uchar *Data, int Length, int64_t pts,
+			bool EndOfFrame, bool KeepPending = false);
+	bool PrepareVideo(cVideoCodec::eCodec codec, const uchar *Data,
+			int &Length, int64_t &pts);
+	bool WriteVideo(const uchar *Data, int Length, int64_t pts,
+			bool EndOfFrame, bool KeepPending, bool DecodeOnly,
+			int generation = -1);
+	void SubmitPendingVideo(bool EndOfFrame);
+#ifdef ENABLE_DIRECT_TS
+	int PlayTsVideoFallback(const uchar *Data, int Length, int payloadLength);
+#endif
 
 	cOmx			 *m_omx;
 	cRpiAudioDecoder *m_audio;
-	cMutex			 *m_mutex;
+	cLivePreRoll	 *m_livePreRoll;
+	cRpiMutex		 *m_mutex;
+	cRpiMutex		 *m_videoMutex;
+	int				  m_videoGeneration;
 	cTimeMs 		 *m_timer;
 
 	cVideoCodec::eCodec	m_videoCodec;
 
 	ePlayMode           m_playMode;
-	eLiveSpeed          m_liveSpeed;
 	ePlaybackSpeed      m_playbackSpeed;
 	eDirection          m_direction;
 
 	bool	m_hasVideo;
 	bool	m_hasAudio;
 
+	bool	m_presetVideoFormat;
+
 	bool	m_skipAudio;
+	bool	m_skipVideo;
 	int		m_playDirection;
 	int		m_trickRequest;
 
 	int64_t	m_audioPts;
 	int64_t	m_videoPts;
 
+	int64_t	m_ptsOffset;
+	int64_t	m_prevPtsOffset;
+	int64_t	m_ptsOffsetStart;
+	int64_t	m_audioPtsOffset;
+	int64_t	m_videoPtsOffset;
+	int		m_audioPtsStep;
+	int		m_videoPtsStep;
+
 	int64_t	m_lastStc;
 
+	uint64_t m_waitForAudio;
+	uint64_t m_releaseFirstPicture;
+	uint64_t m_zapStart;
+
+	int64_t	m_seekTarget;
+	int64_t	m_seekTargetStc;
+	uint64_t m_seekStart;
+	int64_t	m_seekLastPts;
+	bool	m_decodeOnly;
+	int		m_decodeOnlyPictures;
+
+	eStallRecovery	m_stallRecovery;
+	uint64_t		m_lastStall;
+	int				m_stallRecoveries[eNumStallRecoveries];
+	uint64_t		m_stallRecoveryTime[eNumStallRecoveries];
+
+	uint64_t m_stillPictureStart;
+	uint64_t m_lastVideo;
+
+	struct OMX_BUFFERHEADERTYPE *m_pendingVideoBuffer;
+	bool	m_directTs;
+	uint64_t m_copiedBytes;
+	uint64_t m_copyStatTime;
+
+	int		m_liveSpeedCorrection;
+	int		m_liveSpeedIntegral;
+
+	uint8_t	*m_grabBuffer;
+	int		m_grabBufferSize;
+	cMutex	*m_grabMutex;
+
 	int m_display;
 	int m_layer;
 };
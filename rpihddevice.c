@@ -25,6 +25,9 @@
 #include "setup.h"
 #include "display.h"
 #include "tools.h"
+#include "jpeg.h"
+
+#include <algorithm>
 
 static const char *VERSION        = "1.0.3";
 static const char *DESCRIPTION    = trNOOP("HD output device for Raspberry Pi");
@@ -56,6 +59,10 @@ public:
 	virtual cOsdObject *MainMenuAction(void) { return NULL; }
 	virtual cMenuSetupPage *SetupMenu(void);
 	virtual bool SetupParse(const char *Name, const char *Value);
+	virtual bool Service(const char *Id, void *Data = NULL);
+	virtual const char **SVDRPHelpPages(void);
+	virtual cString SVDRPCommand(const char *Command, const char *Option,
+			int &ReplyCode);
 };
 
 cPluginRpiHdDevice::cPluginRpiHdDevice(void) : 
@@ -116,4 +123,129 @@ const char *cPluginRpiHdDevice::CommandLineHelp(void)
 	return cRpiSetup::GetInstance()->CommandLineHelp();
 }
 
+bool cPluginRpiHdDevice::Service(const char *Id, void *Data)
+{
+	// Data points to the int64_t PTS of the first picture to be shown after
+	// the player has cleared the device and jumped to the preceding I-frame
+	if (!strcmp(Id, "RpiHdDevice-SeekTarget-v1.0"))
+	{
+		if (Data)
+			m_device->SetSeekTarget(*static_cast<int64_t*>(Data));
+		return true;
+	}
+	return false;
+}
+
+const char **cPluginRpiHdDevice::SVDRPHelpPages(void)
+{
+	static const char *HelpPages[] = {
+		"GBNC [ <count> [ <width> <height> [ JPEG | PNM [ <quality> ] ] ] ]\n"
+		"    Grab <count> images and report the achieved grabs per second.",
+		"JBNC [ <count> ]\n"
+		"    Compare VDR's and the plugin's JPEG encoder by encoding <count>\n"
+		"    grabbed images at several resolutions and qualities.",
+		NULL
+	};
+	return HelpPages;
+}
+
+cString cPluginRpiHdDevice::SVDRPCommand(const char *Command,
+		const char *Option, int &ReplyCode)
+{
+	if (!strcasecmp(Command, "GBNC"))
+	{
+		int count = 100, width = -1, height = -1, quality = -1;
+		char format[8] = "JPEG";
+		sscanf(Option, "%d %d %d %7s %d",
+				&count, &width, &height, format, &quality);
+		bool jpeg = strcasecmp(format, "PNM");
+
+		if (count <= 0)
+		{
+			ReplyCode = 501;
+			return "invalid number of images";
+		}
+
+		int size = 0;
+		cTimeMs timer;
+		for (int i = 0; i < count; i++)
+		{
+			uchar *image = m_device->GrabImage(size, jpeg, quality,
+					width, height);
+			if (!image)
+			{
+				ReplyCode = 451;
+				return "failed to grab image";
+			}
+			free(image);
+		}
+		uint64_t elapsed = std::max(timer.Elapsed(), (uint64_t)1);
+
+		return cString::sprintf("%d %s images of %d bytes in %llums, "
+				"%.1f grabs/s", count, jpeg ? "JPEG" : "PNM", size,
+				elapsed, count * 1000.0 / elapsed);
+	}
+	else if (!strcasecmp(Command, "JBNC"))
+	{
+		int count = 10;
+		sscanf(Option, "%d", &count);
+		if (count <= 0)
+		{
+			ReplyCode = 501;
+			return "invalid number of images";
+		}
+
+		static const int sizes[][2] = {
+			{ 1920, 1080 }, { 1280, 720 }, { 720, 576 }, { 320, 180 }
+		};
+		static const int qualities[] = { 50, 80, 100 };
+
+		uchar *rgb = MALLOC(uchar, sizes[0][0] * sizes[0][1] * 3);
+		if (!rgb)
+		{
+			ReplyCode = 451;
+			return "failed to allocate image buffer";
+		}
+
+		cString reply = cString::sprintf("encoding %d images on %d cores:",
+				count, cRpiJpegEncoder::NumCores());
+
+		for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+		{
+			int width = sizes[s][0], height = sizes[s][1];
+			if (cRpiDisplay::Snapshot(rgb, width, height))
+			{
+				free(rgb);
+				ReplyCode = 451;
+				return "failed to grab image";
+			}
+
+			for (unsigned int q = 0;
+					q < sizeof(qualities) / sizeof(qualities[0]); q++)
+			{
+				int vdrSize = 0, rpiSize = 0;
+				cTimeMs timer;
+				for (int i = 0; i < count; i++)
+					free(RgbToJpeg(rgb, width, height, vdrSize, qualities[q]));
+
+				uint64_t vdrTime = timer.Elapsed();
+				timer.Set();
+				for (int i = 0; i < count; i++)
+					free(cRpiJpegEncoder::Encode(rgb, width, height,
+							qualities[q], rpiSize));
+
+				uint64_t rpiTime = timer.Elapsed();
+				reply = cString::sprintf("%s\n%4dx%-4d Q=%3d: "
+						"VDR %5.1fms %7d bytes, rpihddevice %5.1fms %7d bytes",
+						*reply, width, height, qualities[q],
+						(double)vdrTime / count, vdrSize,
+						(double)rpiTime / count, rpiSize);
+			}
+		}
+		free(rgb);
+		return reply;
+	}
+	return NULL;
+}
+
 VDRPLUGINCREATOR(cPluginRpiHdDevice); // Don't touch this! okay.
@@ -40,11 +40,13 @@ public:
 	cRpiSetupPage(
 			cRpiSetup::AudioParameters audio,
 			cRpiSetup::VideoParameters video,
-			cRpiSetup::OsdParameters osd) :
+			cRpiSetup::OsdParameters osd,
+			cRpiSetup::PlaybackParameters playback) :
 
 		m_audio(audio),
 		m_video(video),
-		m_osd(osd)
+		m_osd(osd),
+		m_playback(playback)
 	{
 		m_audioPort[0] = tr("analog");
 		m_audioPort[1] = tr("HDMI");
@@ -111,7 +113,11 @@ protected:
 
 		SetupStore("AcceleratedOsd", m_osd.accelerated);
 
-		cRpiSetup::GetInstance()->Set(m_audio, m_video, m_osd);
+		SetupStore("LiveLatency", m_playback.liveLatency);
+		SetupStore("AudioFirstStart", m_playback.audioFirstStart);
+		SetupStore("GrabVideoOnly", m_playback.grabVideoOnly);
+
+		cRpiSetup::GetInstance()->Set(m_audio, m_video, m_osd, m_playback);
 }
 
 private:
@@ -150,6 +156,15 @@ private:
 		Add(new cMenuEditBoolItem(
 				tr("Use GPU accelerated OSD"), &m_osd.accelerated));
 
+		Add(new cMenuEditIntItem(
+				tr("Live TV Latency (ms)"), &m_playback.liveLatency, 50, 2000));
+
+		Add(new cMenuEditBoolItem(
+				tr("Start Live TV With Audio"), &m_playback.audioFirstStart));
+
+		Add(new cMenuEditBoolItem(
+				tr("Grab Video Only"), &m_playback.grabVideoOnly));
+
 		SetCurrent(Get(current));
 		Display();
 	}
@@ -157,6 +172,7 @@ private:
 	cRpiSetup::AudioParameters m_audio;
 	cRpiSetup::VideoParameters m_video;
 	cRpiSetup::OsdParameters   m_osd;
+	cRpiSetup::PlaybackParameters m_playback;
 
 	const char *m_audioPort[2];
 	const char *m_audioFormat[3];
@@ -309,9 +325,21 @@ void cRpiSetup::SetHDMIChannelMapping(bool passthrough, int channels)
 	vc_gencmd(response, sizeof(response), command);
 }
 
+int cRpiSetup::GetFreeGpuMemory(void)
+{
+	char response[80];
+	int mem = -1;
+
+	if (!vc_gencmd(response, sizeof(response), "get_mem reloc"))
+		if (sscanf(response, "reloc=%dM", &mem) != 1)
+			mem = -1;
+
+	return mem;
+}
+
 cMenuSetupPage* cRpiSetup::GetSetupPage(void)
 {
-	return new cRpiSetupPage(m_audio, m_video, m_osd);
+	return new cRpiSetupPage(m_audio, m_video, m_osd, m_playback);
 }
 
 bool cRpiSetup::Parse(const char *name, const char *value)
@@ -330,13 +358,19 @@ bool cRpiSetup::Parse(const char *name, const char *value)
 		m_video.advancedDeinterlacer = atoi(value);
 	else if (!strcasecmp(name, "AcceleratedOsd"))
 		m_osd.accelerated = atoi(value);
+	else if (!strcasecmp(name, "LiveLatency"))
+		m_playback.liveLatency = atoi(value);
+	else if (!strcasecmp(name, "AudioFirstStart"))
+		m_playback.audioFirstStart = atoi(value);
+	else if (!strcasecmp(name, "GrabVideoOnly"))
+		m_playback.grabVideoOnly = atoi(value);
 	else return false;
 
 	return true;
 }
 
 void cRpiSetup::Set(AudioParameters audio, VideoParameters video,
-		OsdParameters osd)
+		OsdParameters osd, PlaybackParameters playback)
 {
 	if (audio != m_audio)
 	{
@@ -357,6 +391,9 @@ void cRpiSetup::Set(AudioParameters audio, VideoParameters video,
 		m_osd = osd;
 		cRpiOsdProvider::ResetOsd(false);
 	}
+
+	if (playback != m_playback)
+		m_playback = playback;
 }
 
 bool cRpiSetup::ProcessArgs(int argc, char *argv[])
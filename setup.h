@@ -79,6 +79,24 @@ public:
 		}
 	};
 
+	struct PlaybackParameters
+	{
+		PlaybackParameters() :
+			liveLatency(250),
+			audioFirstStart(0),
+			grabVideoOnly(0) { }
+
+		int liveLatency;
+		int audioFirstStart;
+		int grabVideoOnly;
+
+		bool operator!=(const PlaybackParameters& a) {
+			return (a.liveLatency != liveLatency) ||
+					(a.audioFirstStart != audioFirstStart) ||
+					(a.grabVideoOnly != grabVideoOnly);
+		}
+	};
+
 	struct PluginParameters
 	{
 		PluginParameters() :
@@ -145,6 +163,18 @@ public:
 			   codec == cVideoCodec::eH264 ? true : false;
 	}
 
+	static int GetLiveLatency(void) {
+		return GetInstance()->m_playback.liveLatency;
+	}
+
+	static bool IsAudioFirstStart(void) {
+		return GetInstance()->m_playback.audioFirstStart != 0;
+	}
+
+	static bool IsGrabVideoOnly(void) {
+		return GetInstance()->m_playback.grabVideoOnly != 0;
+	}
+
 	static bool IsHighLevelOsd(void) {
 		return GetInstance()->m_osd.accelerated != 0;
 	}
@@ -167,13 +197,17 @@ public:
 
 	static void SetHDMIChannelMapping(bool passthrough, int channels);
 
+	// free relocatable GPU memory in MB, -1 if unknown
+	static int GetFreeGpuMemory(void);
+
 	static cRpiSetup* GetInstance(void);
 	static void DropInstance(void);
 
 	class cMenuSetupPage* GetSetupPage(void);
 	bool Parse(const char *name, const char *value);
 
-	void Set(AudioParameters audio, VideoParameters video, OsdParameters osd);
+	void Set(AudioParameters audio, VideoParameters video, OsdParameters osd,
+			PlaybackParameters playback);
 
 	static void SetAudioSetupChangedCallback(void (*callback)(void*), void* data = 0);
 	static void SetVideoSetupChangedCallback(void (*callback)(void*), void* data = 0);
@@ -198,6 +232,7 @@ private:
 	AudioParameters  m_audio;
 	VideoParameters  m_video;
 	OsdParameters    m_osd;
+	PlaybackParameters m_playback;
 	PluginParameters m_plugin;
 
 	bool m_mpeg2Enabled;
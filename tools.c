@@ -18,10 +18,53 @@
  */
 
 #include <limits.h>
+#include <time.h>
 #include <vdr/tools.h>
 #include "tools.h"
 #include <algorithm>
 
+#ifdef DEBUG_LOCKSTAT
+
+#define LOCKSTAT_INTERVAL 10000	// ms
+#define LOCKSTAT_CONTENDED 10	// us
+
+static uint64_t NowUs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+void cRpiMutex::Lock(void)
+{
+	uint64_t start = NowUs();
+	cMutex::Lock();
+	uint64_t wait = NowUs() - start;
+
+	// statistics are protected by the lock itself
+	m_locks++;
+	m_waitUs += wait;
+	m_maxWaitUs = std::max(m_maxWaitUs, wait);
+	if (wait > LOCKSTAT_CONTENDED)
+		m_contended++;
+
+	if (start / 1000 - m_lastLog > LOCKSTAT_INTERVAL)
+	{
+		if (m_lastLog)
+			DLOG("%s lock: %d locks, %d contended, "
+					"wait avg %lluus, max %lluus", m_name, m_locks, m_contended,
+					m_waitUs / std::max(m_locks, 1), m_maxWaitUs);
+
+		m_locks = 0;
+		m_contended = 0;
+		m_waitUs = 0;
+		m_maxWaitUs = 0;
+		m_lastLog = start / 1000;
+	}
+}
+
+#endif
+
 /*
  * ffmpeg's implementation for rational numbers:
  * https://github.com/FFmpeg/FFmpeg/blob/master/libavutil/rational.c
@@ -109,3 +152,35 @@ int cRational::Gcd(int u, int v)
 
     return Gcd((v - u) >> 1, u);
 }
+
+uint32_t cBitStream::GetBits(int n)
+{
+	uint32_t ret = 0;
+	while (n--)
+	{
+		ret <<= 1;
+		if (m_index < m_length)
+			ret |= (m_data[m_index >> 3] >> (7 - (m_index & 7))) & 1;
+		m_index++;
+	}
+	return ret;
+}
+
+/*
+ * Exp-Golomb codes as used in H.264 parameter sets, see ITU-T H.264, 9.1
+ */
+
+uint32_t cBitStream::GetUeGolomb(void)
+{
+	int leadingZeros = 0;
+	while (!GetBit() && !EOS() && leadingZeros < 31)
+		leadingZeros++;
+
+	return ((1 << leadingZeros) - 1) + GetBits(leadingZeros);
+}
+
+int32_t cBitStream::GetSeGolomb(void)
+{
+	uint32_t code = GetUeGolomb();
+	return (code & 1) ? (code + 1) / 2 : -(int32_t)(code / 2);
+}
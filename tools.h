@@ -20,6 +20,9 @@
 #ifndef TOOLS_H
 #define TOOLS_H
 
+#include <stdint.h>
+#include <vdr/thread.h>
+
 #define ELOG(a...) esyslog("rpihddevice: " a)
 #define ILOG(a...) isyslog("rpihddevice: " a)
 #define DLOG(a...) dsyslog("rpihddevice: " a)
@@ -30,6 +33,39 @@
 #define DBG(a...)  void()
 #endif
 
+/*
+ * mutex which measures the time spent waiting for the lock if built with
+ * DEBUG_LOCKSTAT, the statistics are logged every LOCKSTAT_INTERVAL
+ */
+
+class cRpiMutex : public cMutex
+{
+public:
+
+#ifdef DEBUG_LOCKSTAT
+	cRpiMutex(const char *name) : m_name(name), m_locks(0), m_contended(0),
+		m_waitUs(0), m_maxWaitUs(0), m_lastLog(0) { }
+
+	void Lock(void);
+
+private:
+
+	const char *m_name;
+	int m_locks;
+	int m_contended;
+	uint64_t m_waitUs;
+	uint64_t m_maxWaitUs;
+	uint64_t m_lastLog;
+#else
+	cRpiMutex(const char *name) { }
+#endif
+
+private:
+
+	cRpiMutex(const cRpiMutex&);
+	cRpiMutex& operator= (const cRpiMutex&);
+};
+
 class cVideoResolution
 {
 public:
@@ -217,6 +253,12 @@ public:
 	bool Interlaced(void) const {
 		return cScanMode::Interlaced(scanMode);
 	}
+
+	bool operator!=(const cVideoFrameFormat& a) const {
+		return (a.width != width) || (a.height != height) ||
+				(a.frameRate != frameRate) || (a.scanMode != scanMode) ||
+				(a.pixelWidth != pixelWidth) || (a.pixelHeight != pixelHeight);
+	}
 };
 
 class cRational
@@ -237,4 +279,34 @@ private:
 	static int Gcd(int u, int v);
 };
 
+/*
+ * bit reader for video elementary stream headers, reading beyond the end of
+ * the buffer returns zeros and can be detected with EOS()
+ */
+
+class cBitStream
+{
+public:
+
+	cBitStream(const uint8_t *data, int length) :
+		m_data(data), m_length(length * 8), m_index(0) { }
+
+	uint32_t GetBits(int n);
+	uint32_t GetBit(void) { return GetBits(1); }
+	void SkipBits(int n) { m_index += n; }
+
+	uint32_t GetUeGolomb(void);
+	int32_t GetSeGolomb(void);
+
+	bool EOS(void) const { return m_index > m_length; }
+
+private:
+
+	cBitStream();
+
+	const uint8_t *m_data;
+	int m_length;
+	int m_index;
+};
+
 #endif